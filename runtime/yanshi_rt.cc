@@ -0,0 +1,243 @@
+#include "yanshi_rt.hh"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+YanshiImage::~YanshiImage()
+{
+  if (base)
+    munmap((void*)base, size);
+}
+
+// everything the interpreter relies on is checked once here
+static bool validate(const char* base, size_t size, string& err)
+{
+  auto h = (const yanshi_bin_header*)base;
+  auto section = [&](uint64_t off, uint64_t count, uint64_t elem) {
+    return off % 8 == 0 && off <= size && count <= (size-off)/elem;
+  };
+  if (size < sizeof(yanshi_bin_header) || memcmp(h->magic, YANSHI_BIN_MAGIC, sizeof h->magic))
+    return err = "not a yanshi binary", false;
+  if (h->version != YANSHI_BIN_VERSION)
+    return err = "unsupported version "+to_string(h->version), false;
+  if (h->size != size)
+    return err = "truncated", false;
+  if (h->input > YANSHI_BIN_UTF8 || ! section(h->strings, h->strings_size, 1) || (h->strings_size && base[h->strings+h->strings_size-1]) || ! section(h->automata, h->n_automata, sizeof(yanshi_bin_automaton)))
+    return err = "corrupted header", false;
+  auto str = [&](uint64_t off) { return off < h->strings_size; };
+  for (uint64_t i = 0; i < h->n_automata; i++) {
+    auto& a = ((const yanshi_bin_automaton*)(base+h->automata))[i];
+    uint64_t n = a.n_states, words = (n+63)/64;
+    err = "corrupted automaton "+to_string(i);
+    if (a.n_states <= 0 || a.start < 0 || a.start >= a.n_states || a.n_edges < 0 || ! str(a.name) ||
+        ! section(a.edge_offset, n+1, 8) || ! section(a.edges, a.n_edges, sizeof(yanshi_bin_edge)) ||
+        ! section(a.final, words, 8) || ! section(a.sub_final, words, 8) || (a.calls && ! section(a.calls, n, sizeof(yanshi_bin_call))))
+      return false;
+    auto off = (const int64_t*)(base+a.edge_offset);
+    auto es = (const yanshi_bin_edge*)(base+a.edges);
+    if (off[0] != 0 || off[n] != a.n_edges)
+      return false;
+    for (uint64_t u = 0; u < n; u++) {
+      if (off[u] > off[u+1])
+        return false;
+      for (int64_t j = off[u]; j < off[u+1]; j++)
+        if (es[j].from >= es[j].to || es[j].target < 0 || es[j].target >= a.n_states || (j > off[u] && es[j-1].to > es[j].from))
+          return false;
+    }
+    if (a.calls) {
+      auto calls = (const yanshi_bin_call*)(base+a.calls);
+      for (uint64_t u = 0; u < n; u++)
+        if (calls[u].start >= a.n_states || calls[u].ret >= a.n_states || (calls[u].start >= 0 && calls[u].ret < 0))
+          return false;
+    }
+    if (a.action_offset) {
+      if (! section(a.action_offset, a.n_edges+1, 8) || a.n_actions < 0 || ! section(a.action_code, a.n_actions, 8))
+        return false;
+      auto aoff = (const int64_t*)(base+a.action_offset);
+      if (aoff[0] != 0 || aoff[a.n_edges] < 0 || ! section(a.action_ids, aoff[a.n_edges], 8))
+        return false;
+      auto ids = (const int64_t*)(base+a.action_ids);
+      for (int64_t j = 0; j < a.n_edges; j++)
+        if (aoff[j] > aoff[j+1])
+          return false;
+      for (int64_t j = 0; j < aoff[a.n_edges]; j++)
+        if (ids[j] < 0 || ids[j] >= a.n_actions)
+          return false;
+      auto codes = (const uint64_t*)(base+a.action_code);
+      for (int64_t j = 0; j < a.n_actions; j++)
+        if (! str(codes[j]))
+          return false;
+    }
+  }
+  err.clear();
+  return true;
+}
+
+shared_ptr<const YanshiImage> YanshiImage::open(const char* path, string* err)
+{
+  string e;
+  shared_ptr<YanshiImage> r;
+  int fd = ::open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0)
+    e = string(path)+": "+strerror(errno);
+  else {
+    r = make_shared<YanshiImage>();
+    r->size = st.st_size;
+    void* p = r->size ? mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (p == MAP_FAILED) {
+      e = string(path)+": "+(r->size ? strerror(errno) : "empty");
+      r.reset();
+    } else {
+      r->base = (const char*)p;
+      if (! validate(r->base, r->size, e)) {
+        e = string(path)+": "+e;
+        r.reset();
+      }
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+  if (err)
+    *err = e;
+  return r;
+}
+
+const yanshi_bin_automaton* YanshiImage::automaton(long i) const
+{
+  return 0 <= i && i < n_automata() ? (const yanshi_bin_automaton*)(base+header().automata)+i : nullptr;
+}
+
+const yanshi_bin_automaton* YanshiImage::find(const char* name) const
+{
+  for (long i = 0; i < n_automata(); i++)
+    if (! strcmp(string_at(automaton(i)->name), name))
+      return automaton(i);
+  return nullptr;
+}
+
+YanshiMatcher::YanshiMatcher(shared_ptr<const YanshiImage> image, const char* name) : image(move(image))
+{
+  if (this->image)
+    a = this->image->find(name);
+}
+
+bool YanshiMatcher::is_final(const vector<long>& ret_stack, long u) const
+{
+  for (auto i = ret_stack.size(); i; u = ret_stack[--i])
+    if (! bit(a->sub_final, u))
+      return false;
+  return bit(a->final, u);
+}
+
+long YanshiMatcher::transit(vector<long>& ret_stack, long u, long c, long* edge) const
+{
+  auto off = at<int64_t>(a->edge_offset);
+  auto es = at<yanshi_bin_edge>(a->edges);
+  auto calls = a->calls ? at<yanshi_bin_call>(a->calls) : nullptr;
+  if (edge)
+    *edge = -1;
+  if (u < 0 || a->n_states <= u)
+    return -1;
+  for(;;) {
+    // CallExpr: no other transitions
+    if (calls && calls[u].start >= 0) {
+      ret_stack.push_back(calls[u].ret);
+      u = calls[u].start;
+      continue;
+    }
+    auto b = es+off[u], e = es+off[u+1];
+    auto it = upper_bound(b, e, c, [](long c, const yanshi_bin_edge& x) { return c < x.from; });
+    if (it != b && c < it[-1].to) {
+      if (edge)
+        *edge = it-1-es;
+      return it[-1].target;
+    }
+    // return from finals of DefineStmt called by CallExpr
+    if (ret_stack.size() && bit(a->sub_final, u)) {
+      u = ret_stack.back();
+      ret_stack.pop_back();
+      continue;
+    }
+    return -1;
+  }
+}
+
+// same as yanshi_utf8_decode in the generated code: returns `p` for an incomplete sequence
+static const uint8_t* utf8_decode(const uint8_t* p, const uint8_t* pe, long* c)
+{
+  long i, n, x = *p;
+  if (x < 0x80) { *c = x; return p+1; }
+  if (x < 0xc2 || x > 0xf4) { *c = 0xfffd; return p+1; }
+  n = x < 0xe0 ? 1 : x < 0xf0 ? 2 : 3;
+  x &= 0x3f >> n;
+  for (i = 1; i <= n; i++) {
+    if (p+i >= pe) return p;
+    if ((p[i] & 0xc0) != 0x80) { *c = 0xfffd; return p+i; }
+    x = x << 6 | (p[i] & 0x3f);
+  }
+  if (n == 2 ? x < 0x800 || (0xd800 <= x && x < 0xe000) : n == 3 && (x < 0x10000 || x > 0x10ffff))
+    x = 0xfffd;
+  *c = x;
+  return p+n+1;
+}
+
+const uint8_t* YanshiMatcher::exec(vector<long>& ret_stack, long* state, const uint8_t* p, const uint8_t* pe) const
+{
+  long u = *state, c;
+  bool decode = image->header().input == YANSHI_BIN_CODEPOINTS;
+  for (const uint8_t* q; p < pe; p = q) {
+    if (decode) {
+      if ((q = utf8_decode(p, pe, &c)) == p)
+        break;
+    } else {
+      c = *p;
+      q = p+1;
+    }
+    if ((u = transit(ret_stack, u, c)) < 0)
+      break;
+  }
+  *state = u;
+  return p;
+}
+
+const int64_t* YanshiMatcher::actions(long edge, long* n) const
+{
+  if (! a->action_offset || edge < 0 || a->n_edges <= edge) {
+    *n = 0;
+    return nullptr;
+  }
+  auto off = at<int64_t>(a->action_offset);
+  *n = off[edge+1]-off[edge];
+  return at<int64_t>(a->action_ids)+off[edge];
+}
+
+const char* YanshiMatcher::action_code(long id) const
+{
+  return 0 <= id && id < a->n_actions ? image->string_at(at<uint64_t>(a->action_code)[id]) : nullptr;
+}
+
+shared_ptr<const YanshiImage> YanshiReloadable::snapshot() const
+{
+  return atomic_load(&cur);
+}
+
+void YanshiReloadable::swap(shared_ptr<const YanshiImage> image)
+{
+  atomic_store(&cur, move(image));
+}
+
+bool YanshiReloadable::reload(const char* path, string* err)
+{
+  auto image = YanshiImage::open(path, err);
+  if (! image)
+    return false;
+  swap(move(image));
+  return true;
+}
@@ -0,0 +1,66 @@
+#pragma once
+// libyanshi_rt: match with automata written by `yanshi --emit-binary` without generating C++.
+// Transit/is_final/exec behave like the generated yanshi_X_transit/yanshi_X_is_final/yanshi_X_exec (C++ variant).
+#include "binary_format.hh"
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// A memory-mapped --emit-binary file. Immutable, may be shared by threads.
+struct YanshiImage {
+  const char* base = nullptr;
+  size_t size = 0;
+
+  YanshiImage() = default;
+  YanshiImage(const YanshiImage&) = delete;
+  YanshiImage& operator=(const YanshiImage&) = delete;
+  ~YanshiImage();
+  // nullptr on failure, with the reason in `err`
+  static std::shared_ptr<const YanshiImage> open(const char* path, std::string* err = nullptr);
+  const yanshi_bin_header& header() const { return *(const yanshi_bin_header*)base; }
+  long n_automata() const { return header().n_automata; }
+  const yanshi_bin_automaton* automaton(long i) const;
+  const yanshi_bin_automaton* find(const char* name) const;
+  const char* string_at(uint64_t off) const { return base+header().strings+off; }
+};
+
+// An export of an image. Keeps the image alive.
+struct YanshiMatcher {
+  std::shared_ptr<const YanshiImage> image;
+  const yanshi_bin_automaton* a = nullptr;
+
+  YanshiMatcher() = default;
+  YanshiMatcher(std::shared_ptr<const YanshiImage> image, const char* name);
+  explicit operator bool() const { return a; }
+  const char* name() const { return image->string_at(a->name); }
+  long start() const { return a->start; }
+  bool is_final(const std::vector<long>& ret_stack, long u) const;
+  // the next state or -1. `edge` receives the index of the taken edge (-1 if none), see actions()
+  long transit(std::vector<long>& ret_stack, long u, long c, long* edge = nullptr) const;
+  // runs over [p, pe) from *state, returns the stop position. *state becomes -1 if the automaton dies
+  const uint8_t* exec(std::vector<long>& ret_stack, long* state, const uint8_t* p, const uint8_t* pe) const;
+  // action ids of an edge, in the order the generated code runs them
+  const int64_t* actions(long edge, long* n) const;
+  const char* action_code(long id) const;
+
+private:
+  template<class T>
+  const T* at(uint64_t off) const { return (const T*)(image->base+off); }
+  bool bit(uint64_t off, long u) const {
+    return 0 <= u && u < a->n_states && at<uint64_t>(off)[u/64] >> u%64 & 1;
+  }
+};
+
+// Holds the current image for hot reloading: workers snapshot() per request and keep matching on it,
+// while another thread swap()s in a new image. The old image is unmapped when its last user is gone.
+struct YanshiReloadable {
+  std::shared_ptr<const YanshiImage> snapshot() const;
+  void swap(std::shared_ptr<const YanshiImage> image);
+  // opens `path` and swaps it in, keeping the current image on failure
+  bool reload(const char* path, std::string* err = nullptr);
+
+private:
+  std::shared_ptr<const YanshiImage> cur;
+};
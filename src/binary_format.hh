@@ -0,0 +1,52 @@
+#pragma once
+// Layout of the file written by --emit-binary. All integers are native-endian and every section is 8-byte aligned,
+// so a reader can mmap the file and use the arrays in place. Offsets are from the beginning of the file.
+#include <stdint.h>
+
+#define YANSHI_BIN_MAGIC "yanshiB"
+#define YANSHI_BIN_VERSION 1
+
+// input symbols of transit
+enum {
+  YANSHI_BIN_CODEPOINTS = 0, // codepoints decoded from UTF-8
+  YANSHI_BIN_BYTES = 1,      // -b
+  YANSHI_BIN_UTF8 = 2,       // --utf8
+};
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t input;
+  uint64_t size;              // of the file
+  int64_t max_return_stack;
+  uint64_t n_automata;
+  uint64_t automata;          // yanshi_bin_automaton[n_automata]
+  uint64_t strings;           // NUL-terminated strings
+  uint64_t strings_size;
+} yanshi_bin_header;
+
+typedef struct {
+  int64_t from, to;           // label interval [from, to)
+  int64_t target;
+} yanshi_bin_edge;
+
+typedef struct {
+  int64_t start, ret;         // CallExpr: jump to `start` and push `ret`, -1 if the state is not a call
+} yanshi_bin_call;
+
+typedef struct {
+  uint64_t name;              // offset in strings
+  int64_t start;
+  int64_t n_states;
+  int64_t n_edges;
+  uint64_t edge_offset;       // int64_t[n_states+1], edges of state u are [edge_offset[u], edge_offset[u+1])
+  uint64_t edges;             // yanshi_bin_edge[n_edges], sorted by label within a state
+  uint64_t final;             // uint64_t[(n_states+63)/64] bitmap
+  uint64_t sub_final;         // uint64_t[(n_states+63)/64] bitmap, finals of DefineStmt called by CallExpr
+  uint64_t calls;             // yanshi_bin_call[n_states], 0 if there is no CallExpr
+  // optional action index, 0 if no edge has actions
+  uint64_t action_offset;     // int64_t[n_edges+1], actions of edge i are action_ids[action_offset[i] .. action_offset[i+1])
+  uint64_t action_ids;        // int64_t[]
+  int64_t n_actions;
+  uint64_t action_code;       // uint64_t[n_actions], offsets in strings of the action code
+} yanshi_bin_automaton;
@@ -0,0 +1,446 @@
+#include "cache.hh"
+#include "common.hh"
+#include "loader.hh"
+#include "option.hh"
+
+#include <algorithm>
+#include <array>
+#include <limits.h>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+using namespace std;
+
+static const u64 CACHE_VERSION = 1;
+static const char CACHE_MAGIC[8] = {'y', 'a', 'n', 's', 'h', 'i', 'C', '\0'};
+
+// guards the maps below; DefineStmt and exports are compiled concurrently with -j
+static mutex mu;
+// [begin, end) of action/call/collapse labels allocated while compiling a DefineStmt
+static unordered_map<DefineStmt*, array<Label, 3>> stmt2labels;
+static unordered_map<DefineStmt*, string> stmt2key;
+static unordered_map<DefineStmt*, vector<Expr*>> stmt2exprs;
+
+struct Hasher {
+  u64 a = 0xcbf29ce484222325, b = 0x84222325cbf29ce4;
+  void add(const void* data, size_t n) {
+    auto p = (const u8*)data;
+    REP(i, n) {
+      a = (a ^ p[i]) * 0x100000001b3;
+      b = (b ^ p[i]) * 0x9e3779b97f4a7c15;
+      b ^= b >> 29;
+    }
+  }
+  void add(long x) { add(&x, sizeof x); }
+  void add(const string& x) {
+    add(long(x.size()));
+    add(x.data(), x.size());
+  }
+  string hex() const {
+    char buf[33];
+    snprintf(buf, sizeof buf, "%016lx%016lx", ulong(a), ulong(b));
+    return buf;
+  }
+};
+
+static string stmt_key(DefineStmt* stmt);
+
+// Action code is not hashed: only the number of actions affects the automaton
+struct KeyHasher : PrePostActionExprStmtVisitor {
+  Hasher& h;
+  KeyHasher(Hasher& h) : h(h) {}
+
+  void pre_expr(Expr& expr) override {
+    h.add(expr.name());
+    h.add(long(expr.entering.size()));
+    h.add(long(expr.finishing.size()));
+    h.add(long(expr.leaving.size()));
+    h.add(long(expr.transiting.size()));
+  }
+  void visit(BracketExpr& expr) override {
+    h.add(long(expr.intervals.to.size()));
+    for (auto& x: expr.intervals.to) {
+      h.add(x.first);
+      h.add(x.second);
+    }
+  }
+  void visit(EmbedExpr& expr) override {
+    if (expr.define_stmt)
+      h.add(stmt_key(expr.define_stmt));
+    else
+      h.add(expr.macro_value);
+  }
+  void visit(LiteralExpr& expr) override {
+    h.add(expr.literal);
+  }
+  void visit(RepeatExpr& expr) override {
+    h.add(expr.low);
+    h.add(expr.high);
+    PrePostActionExprStmtVisitor::visit(expr);
+  }
+};
+
+static string stmt_key(DefineStmt* stmt)
+{
+  auto it = stmt2key.find(stmt);
+  if (it != stmt2key.end())
+    return it->second;
+  Hasher h;
+  h.add(long(CACHE_VERSION));
+  h.add(long(sizeof(long)));
+  h.add(AB);
+  h.add(long(opt_bytes) | long(opt_utf8) << 1 | long(opt_mode == Mode::interactive) << 2 | long(stmt->intact) << 3 |
+        long(opt_keep_inaccessible || opt_substring_grammar) << 4 | long(opt_derivatives) << 5);
+  h.add(opt_early_minimize);
+  h.add(&opt_early_minimize_eps, sizeof opt_early_minimize_eps);
+  KeyHasher p{h};
+  p.PrePostActionExprStmtVisitor::visit(*stmt->rhs);
+  return stmt2key[stmt] = h.hex();
+}
+
+struct ExprCollector : PrePostActionExprStmtVisitor {
+  vector<Expr*>& exprs;
+  ExprCollector(vector<Expr*>& exprs) : exprs(exprs) {}
+  void pre_expr(Expr& expr) override {
+    if (exprs.size() <= expr.pre)
+      exprs.resize(expr.pre+1);
+    exprs[expr.pre] = &expr;
+  }
+};
+
+// Expr indexed by Expr::pre
+static const vector<Expr*>& stmt_exprs(DefineStmt* stmt)
+{
+  auto it = stmt2exprs.find(stmt);
+  if (it != stmt2exprs.end())
+    return it->second;
+  auto& exprs = stmt2exprs[stmt];
+  ExprCollector p{exprs};
+  p.PrePostActionExprStmtVisitor::visit(*stmt->rhs);
+  return exprs;
+}
+
+static string cache_path(const string& key, const char* suffix)
+{
+  return string(opt_cache_dir)+"/"+key+suffix;
+}
+
+//// Serialization
+
+struct Writer {
+  FILE* f;
+  void put(long x) { fwrite(&x, sizeof x, 1, f); }
+};
+
+struct Reader {
+  FILE* f;
+  long size; // in longs, bounds counts read from a corrupted entry
+  bool ok = true;
+  long get() {
+    long x = 0;
+    if (ok && fread(&x, sizeof x, 1, f) != 1)
+      ok = false;
+    return x;
+  }
+  long get_count(long hi = LONG_MAX) {
+    long x = get();
+    if (x < 0 || hi < x || size < x)
+      ok = false;
+    return ok ? x : 0;
+  }
+};
+
+struct Codec {
+  vector<DefineStmt*> own;
+  unordered_map<Expr*, pair<long, long>> expr2id;
+  // (begin, end, owner, kind) of non-empty label ranges, sorted
+  vector<tuple<long, long, long, long>> ranges;
+
+  Codec(DefineStmt* stmt, bool calls) : own(reachable_define_stmts(stmt, calls)) {}
+
+  bool prepare_encode() {
+    REP(i, own.size()) {
+      auto it = stmt2labels.find(own[i]);
+      if (it == stmt2labels.end())
+        return false;
+      REP(k, 3)
+        if (it->second[k].first < it->second[k].second)
+          ranges.emplace_back(it->second[k].first, it->second[k].second, i, k);
+      auto& exprs = stmt_exprs(own[i]);
+      REP(j, exprs.size())
+        expr2id[exprs[j]] = {i, j};
+    }
+    sort(ALL(ranges));
+    return true;
+  }
+
+  // label pieces: (-1, from, to) below action_label_base, (owner*3+kind, offset_from, offset_to) otherwise
+  bool put_edge(Writer& w, const Edge& e) {
+    vector<long> pieces;
+    for (long x = e.first.first; x < e.first.second; ) {
+      long y;
+      if (x < action_label_base) {
+        y = min(e.first.second, action_label_base);
+        pieces.insert(pieces.end(), {-1, x, y});
+      } else {
+        auto it = upper_bound(ALL(ranges), make_tuple(x, LONG_MAX, 0L, 0L));
+        if (it == ranges.begin() || get<1>(*--it) <= x)
+          return false;
+        y = min(e.first.second, get<1>(*it));
+        pieces.insert(pieces.end(), {get<2>(*it)*3+get<3>(*it), x-get<0>(*it), y-get<0>(*it)});
+      }
+      x = y;
+    }
+    w.put(e.second);
+    w.put(pieces.size()/3);
+    for (long x: pieces)
+      w.put(x);
+    return true;
+  }
+
+  bool put_anno(Writer& w, const FsaAnno& anno) {
+    w.put(anno.deterministic);
+    w.put(anno.fsa.start);
+    w.put(anno.fsa.finals.size());
+    for (long f: anno.fsa.finals)
+      w.put(f);
+    w.put(anno.fsa.n());
+    for (auto& es: anno.fsa.adj) {
+      w.put(es.size());
+      for (auto& e: es)
+        if (! put_edge(w, e))
+          return false;
+    }
+    for (AssocId id: anno.assoc) {
+      auto& as = assoc_set(id);
+      w.put(as.size());
+      for (auto& aa: as) {
+        auto it = expr2id.find(aa.first);
+        if (it == expr2id.end())
+          return false;
+        w.put(it->second.first);
+        w.put(it->second.second);
+        w.put(long(aa.second));
+      }
+    }
+    return true;
+  }
+
+  bool get_anno(Reader& r, FsaAnno& anno) {
+    anno.deterministic = r.get();
+    anno.fsa.start = r.get();
+    anno.fsa.finals.resize(r.get_count());
+    for (long& f: anno.fsa.finals)
+      f = r.get();
+    long n = r.get_count();
+    if (! r.ok || anno.fsa.start < 0 || n <= anno.fsa.start)
+      return false;
+    for (long f: anno.fsa.finals)
+      if (f < 0 || n <= f)
+        return false;
+    anno.fsa.adj.assign(n, {});
+    for (auto& es: anno.fsa.adj) {
+      long m = r.get_count();
+      REP(i, m) {
+        long v = r.get(), np = r.get_count();
+        if (v < 0 || n <= v)
+          return false;
+        REP(j, np) {
+          long kind = r.get(), from = r.get(), to = r.get();
+          if (! r.ok || from >= to)
+            return false;
+          if (kind >= 0) {
+            if (own.size()*3 <= kind)
+              return false;
+            Label rg = stmt2labels[own[kind/3]][kind%3];
+            from += rg.first;
+            to += rg.first;
+            if (rg.second < to)
+              return false;
+          }
+          if (j && es.back().second == v && es.back().first.second == from)
+            es.back().first.second = to;
+          else
+            es.emplace_back(make_pair(from, to), v);
+        }
+      }
+      sort(ALL(es));
+    }
+    anno.assoc.assign(n, 0);
+    for (AssocId& id: anno.assoc) {
+      AssocSet as;
+      long m = r.get_count();
+      REP(i, m) {
+        long k = r.get(), pre = r.get(), tag = r.get();
+        if (! r.ok || k < 0 || own.size() <= k)
+          return false;
+        auto& exprs = stmt_exprs(own[k]);
+        if (pre < 0 || exprs.size() <= pre || ! exprs[pre])
+          return false;
+        as.emplace_back(exprs[pre], ExprTag(tag));
+      }
+      id = assoc_intern(as);
+    }
+    return r.ok;
+  }
+};
+
+static FILE* open_entry(const string& path, Reader& r, long kind)
+{
+  FILE* f = fopen(path.c_str(), "rb");
+  if (! f)
+    return NULL;
+  char magic[sizeof CACHE_MAGIC];
+  struct stat st;
+  r.f = f;
+  r.size = fstat(fileno(f), &st) ? 0 : st.st_size/sizeof(long);
+  if (fread(magic, sizeof magic, 1, f) != 1 || memcmp(magic, CACHE_MAGIC, sizeof magic) || r.get() != CACHE_VERSION || r.get() != kind) {
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
+// write to a temporary file and rename it so that concurrent runs never see a partial entry
+template<typename F>
+static void write_entry(const string& path, long kind, F body)
+{
+  mkdir(opt_cache_dir, 0777);
+  string tmp = path+".tmp"+to_string(getpid());
+  FILE* f = fopen(tmp.c_str(), "wb");
+  if (! f) {
+    err_msg("cache: fopen %s", tmp.c_str());
+    return;
+  }
+  Writer w{f};
+  fwrite(CACHE_MAGIC, sizeof CACHE_MAGIC, 1, f);
+  w.put(CACHE_VERSION);
+  w.put(kind);
+  bool ok = body(w);
+  if (fclose(f) || ! ok || rename(tmp.c_str(), path.c_str())) {
+    if (ok)
+      err_msg("cache: write %s", path.c_str());
+    unlink(tmp.c_str());
+  }
+}
+
+bool cache_load(DefineStmt* stmt, FsaAnno& anno)
+{
+  lock_guard<mutex> lock(mu);
+  string path = cache_path(stmt_key(stmt), ".fsa");
+  Reader r;
+  FILE* f = open_entry(path, r, 0);
+  if (! f)
+    return false;
+  Codec c(stmt, false);
+  array<Label, 3> labels;
+  long* counter[3] = {&action_label, &call_label, &collapse_label};
+  REP(k, 3) {
+    long m = r.get_count();
+    labels[k] = {*counter[k], *counter[k]+m};
+  }
+  stmt2labels[stmt] = labels;
+  bool ok = r.ok && c.get_anno(r, anno);
+  fclose(f);
+  if (! ok) {
+    stmt2labels.erase(stmt);
+    anno = FsaAnno();
+    return false;
+  }
+  REP(k, 3)
+    *counter[k] = labels[k].second;
+  DP(4, "cache hit %s", path.c_str());
+  return true;
+}
+
+void cache_save(DefineStmt* stmt, const FsaAnno& anno, const long label_begin[3])
+{
+  lock_guard<mutex> lock(mu);
+  stmt2labels[stmt] = {Label{label_begin[0], action_label}, Label{label_begin[1], call_label}, Label{label_begin[2], collapse_label}};
+  Codec c(stmt, false);
+  if (! c.prepare_encode())
+    return;
+  write_entry(cache_path(stmt_key(stmt), ".fsa"), 0, [&](Writer& w) {
+    for (auto& x: stmt2labels[stmt])
+      w.put(x.second-x.first);
+    return c.put_anno(w, anno);
+  });
+}
+
+static string export_key(DefineStmt* stmt, const vector<DefineStmt*>& own)
+{
+  Hasher h;
+  h.add(long(opt_substring_grammar && ! stmt->intact));
+  for (auto x: own) {
+    h.add(stmt_key(x));
+    h.add(long(used_as_call.count(x)));
+  }
+  return h.hex();
+}
+
+bool cache_load_export(DefineStmt* stmt, FsaAnno& anno, vector<bool>& sub_final, unordered_map<DefineStmt*, long>& stmt2start)
+{
+  lock_guard<mutex> lock(mu);
+  Codec c(stmt, true);
+  for (auto x: c.own)
+    if (! stmt2labels.count(x))
+      return false;
+  string path = cache_path(export_key(stmt, c.own), ".export");
+  Reader r;
+  FILE* f = open_entry(path, r, 1);
+  if (! f)
+    return false;
+  FsaAnno res;
+  bool ok = c.get_anno(r, res);
+  long n = res.fsa.n();
+  sub_final.assign(n, false);
+  REP(i, n)
+    sub_final[i] = r.get();
+  stmt2start.clear();
+  long m = r.get_count(c.own.size());
+  REP(i, m) {
+    long k = r.get(), u = r.get();
+    if (k < 0 || c.own.size() <= k || u < 0 || n <= u)
+      ok = false;
+    else
+      stmt2start[c.own[k]] = u;
+  }
+  fclose(f);
+  if (! ok || ! r.ok)
+    return false;
+  anno = move(res);
+  DP(3, "cache hit %s", path.c_str());
+  return true;
+}
+
+void cache_save_export(DefineStmt* stmt, const FsaAnno& anno, const vector<bool>& sub_final, const unordered_map<DefineStmt*, long>& stmt2start)
+{
+  lock_guard<mutex> lock(mu);
+  Codec c(stmt, true);
+  if (! c.prepare_encode())
+    return;
+  write_entry(cache_path(export_key(stmt, c.own), ".export"), 1, [&](Writer& w) {
+    if (! c.put_anno(w, anno))
+      return false;
+    for (bool x: sub_final)
+      w.put(x);
+    vector<pair<long, long>> starts;
+    REP(i, c.own.size()) {
+      auto it = stmt2start.find(c.own[i]);
+      if (it != stmt2start.end())
+        starts.emplace_back(i, it->second);
+    }
+    if (starts.size() != stmt2start.size())
+      return false;
+    w.put(starts.size());
+    for (auto& x: starts) {
+      w.put(x.first);
+      w.put(x.second);
+    }
+    return true;
+  });
+}
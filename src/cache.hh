@@ -0,0 +1,14 @@
+#pragma once
+#include "fsa_anno.hh"
+#include "syntax.hh"
+
+#include <unordered_map>
+using std::unordered_map;
+
+// On-disk cache of compiled DefineStmt, keyed by the AST, EmbedExpr dependencies and options.
+// Action/CallExpr/CollapseExpr labels are stored relative to the DefineStmt which allocated them.
+bool cache_load(DefineStmt* stmt, FsaAnno& anno);
+void cache_save(DefineStmt* stmt, const FsaAnno& anno, const long label_begin[3]);
+// exporting DefineStmt after minimization
+bool cache_load_export(DefineStmt* stmt, FsaAnno& anno, vector<bool>& sub_final, unordered_map<DefineStmt*, long>& stmt2start);
+void cache_save_export(DefineStmt* stmt, const FsaAnno& anno, const vector<bool>& sub_final, const unordered_map<DefineStmt*, long>& stmt2start);
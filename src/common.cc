@@ -1,14 +1,19 @@
 #include "common.hh"
 #include "option.hh"
 
+#include <condition_variable>
+#include <deque>
 #include <errno.h>
 #include <execinfo.h>
+#include <mutex>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <sysexits.h>
+#include <thread>
 #include <time.h>
 #include <unistd.h>
+using namespace std;
 
 ///// Error
 
@@ -48,7 +53,8 @@ static const char *ENAME[] = {
 
 #define MAX_ENAME 133
 
-long action_label_base, action_label, call_label_base, call_label, collapse_label_base, collapse_label;
+long action_label_base, call_label_base, collapse_label_base;
+thread_local long action_label, call_label, collapse_label;
 
 void output_error(bool use_err, const char *format, va_list ap)
 {
@@ -109,6 +115,52 @@ long get_long(const char *arg)
   return ret;
 }
 
+//// DAG scheduler
+
+void run_dag(const vector<vector<long>>& succ, long jobs, const function<void(long)>& f)
+{
+  long n = succ.size();
+  if (jobs <= 1) {
+    REP(i, n)
+      f(i);
+    return;
+  }
+  vector<long> indeg(n, 0);
+  deque<long> ready;
+  REP(i, n)
+    for (long j: succ[i])
+      indeg[j]++;
+  REP(i, n)
+    if (! indeg[i])
+      ready.push_back(i);
+  mutex mu;
+  condition_variable cv;
+  long done = 0;
+  auto work = [&]() {
+    unique_lock<mutex> lock(mu);
+    for(;;) {
+      cv.wait(lock, [&]() { return ready.size() || done == n; });
+      if (ready.empty())
+        break;
+      long i = ready.front();
+      ready.pop_front();
+      lock.unlock();
+      f(i);
+      lock.lock();
+      for (long j: succ[i])
+        if (! --indeg[j])
+          ready.push_back(j);
+      done++;
+      cv.notify_all();
+    }
+  };
+  vector<thread> threads;
+  REP(i, min(jobs, n))
+    threads.emplace_back(work);
+  for (auto& t: threads)
+    t.join();
+}
+
 //// log
 //
 
@@ -3,6 +3,7 @@
 # define _GNU_SOURCE
 #endif
 #include <assert.h>
+#include <functional>
 #include <map>
 #include <stdarg.h>
 #include <stdint.h>
@@ -44,7 +45,11 @@ extern char*** _NSGetArgv(void);
 #define CYAN "\x1b[1;36m"
 #define NORMAL_YELLOW "\x1b[33m"
 const long MAX_CODEPOINT = 0x10ffff;
-extern long action_label_base, action_label, call_label_base, call_label, collapse_label_base, collapse_label;
+// Each DefineStmt allocates action/call/collapse labels from its own block of LABEL_BLOCK labels,
+// so that DefineStmt can be compiled concurrently and the numbering does not depend on the schedule
+const long LABEL_BLOCK = 1000000;
+extern long action_label_base, call_label_base, collapse_label_base;
+extern thread_local long action_label, call_label, collapse_label;
 
 void bold(long fd = 1);
 void blue(long fd = 1);
@@ -65,6 +70,21 @@ void err_exit(int exitno, const char *format, ...);
 
 long get_long(const char *arg);
 
+// for unordered_map keyed by vectors of integers
+struct VectorHash {
+  template<class T>
+  size_t operator()(const vector<T>& xs) const {
+    size_t h = xs.size();
+    for (T x: xs)
+      h = h*1000003 ^ size_t(x);
+    return h;
+  }
+};
+
+// Runs f(i) for the nodes of a DAG numbered in a topological order, on `jobs` threads.
+// f(i) starts after f(j) has returned for every j with i in succ[j].
+void run_dag(const vector<vector<long>>& succ, long jobs, const std::function<void(long)>& f);
+
 void log_generic(const char *prefix, const char *format, va_list ap);
 void log_event(const char *format, ...);
 void log_action(const char *format, ...);
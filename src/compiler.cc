@@ -1,27 +1,44 @@
+#include "binary_format.hh"
+#include "cache.hh"
 #include "compiler.hh"
+#include "derivative.hh"
 #include "fsa_anno.hh"
 #include "loader.hh"
 #include "option.hh"
+#include "profile.hh"
 
 #include <algorithm>
+#include <atomic>
 #include <ctype.h>
 #include <limits.h>
 #include <map>
+#include <mutex>
 #include <sstream>
+#include <string.h>
 #include <stack>
+#include <sys/resource.h>
+#include <sysexits.h>
+#include <tuple>
+#include <unistd.h>
 #include <unordered_map>
 using namespace std;
 
 unordered_map<DefineStmt*, FsaAnno> compiled;
 static unordered_map<DefineStmt*, vector<pair<long, long>>> stmt2call_addr;
 static unordered_map<DefineStmt*, vector<bool>> stmt2final;
+// what this thread is expanding, reported by limit_exceeded through fsa_limit_context
+struct Expanding {
+  DefineStmt* stmt;
+  Expr* expr;
+};
+static thread_local Expanding expanding;
 
 void print_assoc(const FsaAnno& anno)
 {
   magenta(); printf("=== Associated Expr of each state\n"); sgr0();
-  REP(i, anno.fsa.n()) {
+  REP(i, anno.assoc.size()) {
     printf("%ld:", i);
-    for (auto aa: anno.assoc[i]) {
+    for (auto aa: assoc_set(anno.assoc[i])) {
       auto a = aa.first;
       printf(" %s%s%s%s(%ld-%ld", a->name().c_str(),
              has_start(aa.second) ? "^" : "",
@@ -63,6 +80,9 @@ void print_automaton(const Fsa& fsa)
       else
         printf(" (%ld-%ld,%ld)", from, to-1, v);
     }
+    if (i < fsa.eps.size())
+      for (long v: fsa.eps[i])
+        printf(" (-1,%ld)", v);
     puts("");
   }
   puts("");
@@ -85,12 +105,12 @@ Expr* find_lca(Expr* u, Expr* v)
   return u->anc[0]; // NULL if two trees
 }
 
-struct Compiler : Visitor<Expr> {
-  stack<FsaAnno> st;
+// Expr::pre/post/depth/anc in the order Compiler visits them
+struct ExprNumbering : Visitor<Expr> {
   stack<Expr*> path;
   long tick = 0;
 
-  void pre_expr(Expr& expr) {
+  virtual void pre_expr(Expr& expr) {
     expr.pre = tick++;
     expr.depth = path.size();
     if (path.size()) {
@@ -102,12 +122,9 @@ struct Compiler : Visitor<Expr> {
     path.push(&expr);
     DP(5, "%s(%ld-%ld)", expr.name().c_str(), expr.loc.start, expr.loc.end);
   }
-  void post_expr(Expr& expr) {
+  virtual void post_expr(Expr& expr) {
     path.pop();
     expr.post = tick;
-#ifdef DEBUG
-    st.top().fsa.check();
-#endif
   }
 
   void visit(Expr& expr) override {
@@ -115,6 +132,100 @@ struct Compiler : Visitor<Expr> {
     expr.accept(*this);
     post_expr(expr);
   }
+  void visit(BracketExpr& expr) override {}
+  void visit(CallExpr& expr) override {}
+  void visit(CollapseExpr& expr) override {}
+  void visit(ComplementExpr& expr) override { visit(*expr.inner); }
+  void visit(ConcatExpr& expr) override {
+    visit(*expr.rhs);
+    visit(*expr.lhs);
+  }
+  void visit(DifferenceExpr& expr) override {
+    visit(*expr.rhs);
+    visit(*expr.lhs);
+  }
+  void visit(DotExpr& expr) override {}
+  void visit(EmbedExpr& expr) override {}
+  void visit(EpsilonExpr& expr) override {}
+  void visit(IntersectExpr& expr) override {
+    visit(*expr.rhs);
+    visit(*expr.lhs);
+  }
+  void visit(LiteralExpr& expr) override {}
+  void visit(PlusExpr& expr) override { visit(*expr.inner); }
+  void visit(QuestionExpr& expr) override { visit(*expr.inner); }
+  void visit(RepeatExpr& expr) override { visit(*expr.inner); }
+  void visit(StarExpr& expr) override { visit(*expr.inner); }
+  void visit(UnionExpr& expr) override {
+    visit(*expr.rhs);
+    visit(*expr.lhs);
+  }
+};
+
+// Names `expr` in limit reports while `f` expands it, then restores the enclosing one
+template<typename F>
+static void expand(Expr& expr, F f)
+{
+  Expr* outer = expanding.expr;
+  expanding.expr = &expr;
+  f();
+  expanding.expr = outer;
+}
+
+// --early-minimize: the automaton of a subexpression is minimized before its parent combines it, once it has grown
+// by the given number of states since its parts were last minimized, or reaches the epsilon edges per state.
+// Not when a state has assoc: merging states would change the actions triggered.
+// Returns whether it was minimized
+static bool early_minimize(FsaAnno& anno, Expr& expr, long settled)
+{
+  long n = anno.fsa.n(), m = 0;
+  for (auto& vs: anno.fsa.eps)
+    m += vs.size();
+  if (! ((opt_early_minimize && n-settled >= opt_early_minimize) || (opt_early_minimize_eps && m >= opt_early_minimize_eps*n)))
+    return false;
+  if (any_of(ALL(anno.assoc), [](AssocId as) { return as != 0; })) {
+    DP(4, "'%s': %s(%ld-%ld) has assoc, not minimized early (%ld states, %ld epsilon)", expanding.stmt->lhs.c_str(), expr.name().c_str(), expr.loc.start, expr.loc.end, n, m);
+    return false;
+  }
+  expand(expr, [&] {
+    vector<long> scale;
+    anno.fsa.compress_labels(scale);
+    if (! anno.deterministic)
+      anno.determinize(NULL, NULL);
+    anno.minimize(NULL);
+    anno.fsa.decompress_labels(scale);
+  });
+  DP(4, "'%s': %s(%ld-%ld) minimized early: %ld states, %ld epsilon -> %ld states", expanding.stmt->lhs.c_str(), expr.name().c_str(), expr.loc.start, expr.loc.end, n, m, anno.fsa.n());
+  return true;
+}
+
+struct Compiler : ExprNumbering {
+  stack<FsaAnno> st;
+  stack<long> settled; // per open Expr: states of its children's automata that are minimal
+
+  using ExprNumbering::visit;
+  void pre_expr(Expr& expr) override {
+    ExprNumbering::pre_expr(expr);
+    settled.push(0);
+  }
+  void post_expr(Expr& expr) override {
+    ExprNumbering::post_expr(expr);
+#ifdef DEBUG
+    st.top().fsa.check();
+#endif
+    long s = settled.top();
+    settled.pop();
+    if (opt_early_minimize || opt_early_minimize_eps) {
+      if (dynamic_cast<EmbedExpr*>(&expr)) // compiled automata are minimal
+        s = st.top().fsa.n();
+      // the root is minimized by compile()
+      else if (settled.size() && early_minimize(st.top(), expr, s))
+        s = st.top().fsa.n();
+      if (settled.size())
+        settled.top() += s;
+    }
+  }
+
   void visit(BracketExpr& expr) override {
     st.push(FsaAnno::bracket(expr));
   }
@@ -126,7 +237,7 @@ struct Compiler : Visitor<Expr> {
   }
   void visit(ComplementExpr& expr) override {
     visit(*expr.inner);
-    st.top().complement(&expr);
+    expand(expr, [&] { st.top().complement(&expr); });
   }
   void visit(ConcatExpr& expr) override {
     visit(*expr.rhs);
@@ -138,7 +249,7 @@ struct Compiler : Visitor<Expr> {
     visit(*expr.rhs);
     FsaAnno rhs = move(st.top());
     visit(*expr.lhs);
-    st.top().difference(rhs, &expr);
+    expand(expr, [&] { st.top().difference(rhs, &expr); });
   }
   void visit(DotExpr& expr) override {
     st.push(FsaAnno::dot(&expr));
@@ -153,7 +264,7 @@ struct Compiler : Visitor<Expr> {
     visit(*expr.rhs);
     FsaAnno rhs = move(st.top());
     visit(*expr.lhs);
-    st.top().intersect(rhs, &expr);
+    expand(expr, [&] { st.top().intersect(rhs, &expr); });
   }
   void visit(LiteralExpr& expr) override {
     st.push(FsaAnno::literal(expr));
@@ -168,7 +279,7 @@ struct Compiler : Visitor<Expr> {
   }
   void visit(RepeatExpr& expr) override {
     visit(*expr.inner);
-    st.top().repeat(expr);
+    expand(expr, [&] { st.top().repeat(expr); });
   }
   void visit(StarExpr& expr) override {
     visit(*expr.inner);
@@ -182,33 +293,410 @@ struct Compiler : Visitor<Expr> {
   }
 };
 
-void compile(DefineStmt* stmt)
+void compile(DefineStmt* stmt, long block)
 {
-  if (compiled.count(stmt))
+  FsaAnno& anno = compiled.at(stmt);
+  Profiler prof(stmt, "DefineStmt", anno);
+  action_label = action_label_base+block*LABEL_BLOCK;
+  call_label = call_label_base+block*LABEL_BLOCK;
+  collapse_label = collapse_label_base+block*LABEL_BLOCK;
+  if (opt_cache_dir) {
+    prof.begin("cache_load");
+    ExprNumbering num;
+    num.visit(*stmt->rhs);
+    if (cache_load(stmt, anno)) {
+      DP(4, "size(%s::%s) = %ld (cached)", stmt->module->filename.c_str(), stmt->lhs.c_str(), anno.fsa.n());
+      return;
+    }
+  }
+  long label_begin[3] = {action_label, call_label, collapse_label};
+  expanding = {stmt, NULL};
+  fsa_limit_context = &expanding;
+  if (opt_derivatives && derivatives_applicable(stmt)) {
+    prof.begin("derivatives");
+    ExprNumbering num;
+    num.visit(*stmt->rhs);
+    anno.fsa = derivatives_dfa(*stmt->rhs);
+    anno.assoc.assign(anno.fsa.n(), 0);
+    anno.deterministic = true;
+    prof.begin("minimize");
+    anno.minimize(NULL);
+  } else {
+    prof.begin("construct");
+    Compiler comp;
+    comp.visit(*stmt->rhs);
+    anno = move(comp.st.top());
+    vector<long> scale;
+    anno.fsa.compress_labels(scale);
+    DP(4, "%zd label classes", scale.size()-1);
+    prof.begin("determinize");
+    anno.determinize(NULL, NULL);
+    prof.begin("minimize");
+    anno.minimize(NULL);
+    anno.fsa.decompress_labels(scale);
+  }
+  prof.end();
+  if (action_label-label_begin[0] > LABEL_BLOCK || call_label-label_begin[1] > LABEL_BLOCK || collapse_label-label_begin[2] > LABEL_BLOCK)
+    err_exit(EX_SOFTWARE, "'%s': more than %ld action/CallExpr/CollapseExpr labels", stmt->lhs.c_str(), LABEL_BLOCK);
+  if (opt_cache_dir) {
+    prof.begin("cache_save");
+    cache_save(stmt, anno, label_begin);
+  }
+  DP(4, "size(%s::%s) = %ld", stmt->module->filename.c_str(), stmt->lhs.c_str(), anno.fsa.n());
+}
+
+// Installed as fsa_limit_exceeded. Other threads may still be running, hence _exit
+void limit_exceeded(const char* construction, long states, long frontier)
+{
+  static mutex mu;
+  auto e = (const Expanding*)fsa_limit_context;
+  if (! e || ! e->stmt)
     return;
+  DefineStmt* stmt = e->stmt;
+  mu.lock();
+  rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  const char* limit = opt_max_states && states > opt_max_states ? "--max-states" : "--max-memory";
+  if (e->expr)
+    stmt->module->locfile.error_context(e->expr->loc, "'%s': %s of %s exceeded %s: %ld states, %ld unexplored, peak RSS %ld MiB", stmt->lhs.c_str(), construction, e->expr->name().c_str(), limit, states, frontier, long(ru.ru_maxrss/1024));
+  else
+    stmt->module->locfile.error_context(stmt->loc, "'%s': %s exceeded %s: %ld states, %ld unexplored, peak RSS %ld MiB", stmt->lhs.c_str(), construction, limit, states, frontier, long(ru.ru_maxrss/1024));
+  fflush(NULL);
+  _exit(EX_DATAERR);
+}
+
+typedef unordered_map<long, pair<vector<pair<long, long>>, vector<pair<Action*, long>>>> Cases;
+
+static void generate_final(const char* name, const vector<bool>& final);
+
+static const char* int_type(long lo, long hi)
+{
+  if (SCHAR_MIN <= lo && hi <= SCHAR_MAX)
+    return "signed char";
+  if (SHRT_MIN <= lo && hi <= SHRT_MAX)
+    return "short";
+  if (INT_MIN <= lo && hi <= INT_MAX)
+    return "int";
+  return "long";
+}
+
+static void generate_array(const char* name, const vector<long>& a)
+{
+  long lo = 0, hi = 0;
+  for (long x: a)
+    lo = min(lo, x), hi = max(hi, x);
+  fprintf(output, "static const %s %s[] = {", int_type(lo, hi), name);
+  REP(i, a.size()) {
+    if (i) fputs(",", output);
+    if (i % 32 == 0) fputs("\n  ", output);
+    fprintf(output, "%ld", a[i]);
+  }
+  fprintf(output, "\n};\n");
+}
+
+// `dead` is the statement executed when the return stack overflows
+static void generate_switch_body(DefineStmt* stmt, vector<Cases>& cases, const function<string(Action*)>& get_code, const char* dead)
+{
   FsaAnno& anno = compiled[stmt];
-  Compiler comp;
-  comp.visit(*stmt->rhs);
-  anno = move(comp.st.top());
-  anno.determinize(NULL, NULL);
-  anno.minimize(NULL);
-  DP(4, "size(%s::%s) = %ld", stmt->module->filename.c_str(), stmt->lhs.c_str(), anno.fsa.n());
+  auto& call_addr = stmt2call_addr[stmt];
+  auto& sub_final = stmt2final[stmt];
+  fprintf(output, "  switch (u) {\n");
+  REP(u, anno.dfa.n()) {
+    if (call_addr[u].first >= 0) { // no other transitions
+      fprintf(output,
+"  case %ld:\n"
+"    u = %ld;\n"
+, u, call_addr[u].first);
+      if (opt_gen_c)
+        fprintf(output,
+"    if (*ret_stack_len >= %ld) %s\n"
+"    ret_stack[(*ret_stack_len)++] = %ld;\n"
+, opt_max_return_stack, dead, call_addr[u].second);
+      else
+        fprintf(output,
+"    ret_stack.push_back(%ld);\n"
+, call_addr[u].second);
+      fprintf(output,
+"    goto again;\n");
+      continue;
+    }
+    if (anno.dfa.adj(u).empty() && ! sub_final[u])
+      continue;
+    indent(output, 1);
+    fprintf(output, "case %ld:\n", u);
+    indent(output, 2);
+    fprintf(output, "switch (c) {\n");
+
+    for (auto& x: cases[u]) {
+      for (auto& y: x.second.first) {
+        indent(output, 2);
+        if (y.first == y.second-1)
+          fprintf(output, "case %ld:\n", y.first);
+        else
+          fprintf(output, "case %ld ... %ld:\n", y.first, y.second-1);
+      }
+      indent(output, 3);
+      fprintf(output, "v = %ld;\n", x.first);
+      for (auto a: x.second.second)
+        fprintf(output, "{%s}\n", get_code(a.first).c_str());
+      indent(output, 3);
+      fprintf(output, "break;\n");
+    }
+    // return from finals of DefineStmt called by CallExpr
+    if (sub_final[u]) {
+      indent(output, 2);
+      fprintf(output, "default:\n");
+      indent(output, 3);
+      fprintf(output, opt_gen_c ?
+"if (*ret_stack_len) { u = ret_stack[--*ret_stack_len]; goto again; }\n"
+:
+"if (ret_stack.size()) { u = ret_stack.back(); ret_stack.pop_back(); goto again; }\n");
+      indent(output, 3);
+      fprintf(output, "break;\n");
+    }
+
+    indent(output, 2);
+    fprintf(output, "}\n");
+    indent(output, 2);
+    fprintf(output, "break;\n");
+  }
+  indent(output, 1);
+  fprintf(output, "}\n");
 }
 
-void generate_transitions(DefineStmt* stmt)
+// Labels are mapped to equivalence classes by a two-level (or one-level for small alphabets) table.
+// next/check/base are the row-displaced transition table: (u, k) -> next[base[u]+k] if check[base[u]+k] == u
+struct Table {
+  long n;
+  vector<long> cls, cls_hi, cls_lo, base, next, check, act, call_to, call_ret;
+  vector<vector<pair<Action*, long>>> actions;
+  bool has_call = false, has_sub_final = false;
+};
+
+static void build_table(DefineStmt* stmt, vector<Cases>& cases, Table& t)
 {
   FsaAnno& anno = compiled[stmt];
   auto& call_addr = stmt2call_addr[stmt];
   auto& sub_final = stmt2final[stmt];
+  long n = t.n = anno.dfa.n();
+
+  // equivalence classes of labels
+  vector<long> scale{0, AB};
+  REP(u, n)
+    if (call_addr[u].first < 0)
+      for (auto& x: cases[u])
+        for (auto& y: x.second.first)
+          if (y.first < AB) {
+            scale.push_back(y.first);
+            scale.push_back(min(y.second, AB));
+          }
+  sort(ALL(scale));
+  scale.erase(unique(ALL(scale)), scale.end());
+  long nclass = scale.size()-1;
+  auto class_of = [&](long c) { return long(upper_bound(ALL(scale), c)-scale.begin()-1); };
+
+  // rows
+  map<vector<pair<Action*, long>>, long> action2id;
+  auto& actions = t.actions;
+  actions.resize(1);
+  vector<vector<tuple<long, long, long>>> rows(n); // (class, target, action)
+  REP(u, n)
+    if (call_addr[u].first < 0)
+      for (auto& x: cases[u]) {
+        long a = 0;
+        if (x.second.second.size()) {
+          auto it = action2id.find(x.second.second);
+          if (it == action2id.end()) {
+            it = action2id.emplace(x.second.second, actions.size()).first;
+            actions.push_back(x.second.second);
+          }
+          a = it->second;
+        }
+        for (auto& y: x.second.first)
+          if (y.first < AB)
+            FOR(k, class_of(y.first), class_of(min(y.second, AB)))
+              rows[u].emplace_back(k, x.first, a);
+      }
+
+  // row displacement, denser rows first
+  vector<long> order(n);
+  auto &base = t.base, &next = t.next, &check = t.check, &act = t.act;
+  base.assign(n, 0);
+  REP(u, n) {
+    order[u] = u;
+    sort(ALL(rows[u]));
+  }
+  stable_sort(ALL(order), [&](long x, long y) { return rows[x].size() > rows[y].size(); });
+  long free_from = 0;
+  for (long u: order) {
+    if (rows[u].empty()) break;
+    long b = max(0L, free_from-get<0>(rows[u][0]));
+    for (; ; b++) {
+      bool ok = true;
+      for (auto& e: rows[u])
+        if (b+get<0>(e) < check.size() && check[b+get<0>(e)] >= 0) {
+          ok = false;
+          break;
+        }
+      if (ok) break;
+    }
+    base[u] = b;
+    if (check.size() < b+nclass) {
+      check.resize(b+nclass, -1);
+      next.resize(b+nclass, -1);
+      act.resize(b+nclass, 0);
+    }
+    for (auto& e: rows[u]) {
+      long i = b+get<0>(e);
+      check[i] = u;
+      next[i] = get<1>(e);
+      act[i] = get<2>(e);
+    }
+    while (free_from < check.size() && check[free_from] >= 0)
+      free_from++;
+  }
+  check.resize(max(long(check.size()), nclass), -1);
+  next.resize(check.size(), -1);
+  act.resize(check.size(), 0);
+  DP(3, "table: %ld classes, %zd slots", nclass, check.size());
+
+  if (AB <= 256) {
+    t.cls.resize(AB);
+    REP(c, AB)
+      t.cls[c] = class_of(c);
+  } else {
+    long nblock = (AB+255)/256;
+    map<vector<long>, long> block2id;
+    t.cls_hi.resize(nblock);
+    REP(i, nblock) {
+      vector<long> block(256);
+      REP(j, 256)
+        block[j] = i*256+j < AB ? class_of(i*256+j) : -1;
+      auto it = block2id.find(block);
+      if (it == block2id.end()) {
+        it = block2id.emplace(block, block2id.size()).first;
+        t.cls_lo.insert(t.cls_lo.end(), ALL(block));
+      }
+      t.cls_hi[i] = it->second;
+    }
+  }
+  REP(u, n) {
+    if (call_addr[u].first >= 0)
+      t.has_call = true;
+    if (sub_final[u])
+      t.has_sub_final = true;
+  }
+  if (t.has_call) {
+    t.call_to.resize(n);
+    t.call_ret.resize(n);
+    REP(u, n)
+      tie(t.call_to[u], t.call_ret[u]) = call_addr[u];
+  }
+}
+
+// shared by yanshi_%s_transit and yanshi_%s_exec
+static void generate_table_data(DefineStmt* stmt, const Table& t)
+{
+  auto gen = [&](const char* name, const vector<long>& a) {
+    generate_array(("yanshi_"+stmt->lhs+"_"+name).c_str(), a);
+  };
+  if (AB <= 256)
+    gen("cls", t.cls);
+  else {
+    gen("cls_hi", t.cls_hi);
+    gen("cls_lo", t.cls_lo);
+  }
+  gen("base", t.base);
+  gen("next", t.next);
+  gen("check", t.check);
+  if (t.actions.size() > 1)
+    gen("act", t.act);
+  if (t.has_call) {
+    gen("call_to", t.call_to);
+    gen("call_ret", t.call_ret);
+  }
+  if (t.has_sub_final)
+    generate_final(("yanshi_"+stmt->lhs+"_sub_").c_str(), stmt2final[stmt]);
+  fprintf(output, "\n");
+}
+
+static void generate_table_body(DefineStmt* stmt, const Table& t, const function<string(Action*)>& get_code, const char* dead)
+{
+  const char* name = stmt->lhs.c_str();
+  fprintf(output, "  if (u < 0 || u >= %ld) %s\n", t.n, dead);
+  if (t.has_call) {
+    fprintf(output, "  if (yanshi_%s_call_to[u] >= 0) {\n", name);
+    if (opt_gen_c)
+      fprintf(output,
+"    if (*ret_stack_len >= %ld) %s\n"
+"    ret_stack[(*ret_stack_len)++] = yanshi_%s_call_ret[u];\n"
+, opt_max_return_stack, dead, name);
+    else
+      fprintf(output, "    ret_stack.push_back(yanshi_%s_call_ret[u]);\n", name);
+    fprintf(output,
+"    u = yanshi_%s_call_to[u];\n"
+"    goto again;\n"
+"  }\n", name);
+  }
+  if (AB <= 256)
+    fprintf(output, "  k = 0 <= c && c < %ld ? yanshi_%s_cls[c] : -1;\n", AB, name);
+  else
+    fprintf(output, "  k = 0 <= c && c < %ld ? yanshi_%s_cls_lo[yanshi_%s_cls_hi[c >> 8] << 8 | (c & 255)] : -1;\n", AB, name, name);
+  fprintf(output,
+"  if (0 <= k && yanshi_%s_check[i = yanshi_%s_base[u]+k] == u) {\n"
+"    v = yanshi_%s_next[i];\n", name, name, name);
+  if (t.actions.size() > 1) {
+    fprintf(output, "    switch (yanshi_%s_act[i]) {\n", name);
+    FOR(i, 1, t.actions.size()) {
+      fprintf(output, "    case %ld:\n", i);
+      for (auto a: t.actions[i])
+        fprintf(output, "{%s}\n", get_code(a.first).c_str());
+      fprintf(output, "      break;\n");
+    }
+    fprintf(output, "    }\n");
+  }
+  fprintf(output, "  }");
+  // return from finals of DefineStmt called by CallExpr
+  if (t.has_sub_final)
+    fprintf(output, opt_gen_c ?
+" else if (yanshi_%s_sub_final[u/(CHAR_BIT*sizeof(long))] >> (u%%(CHAR_BIT*sizeof(long))) & 1 && *ret_stack_len) {\n"
+"    u = ret_stack[--*ret_stack_len];\n"
+"    goto again;\n"
+"  }"
+:
+" else if (yanshi_%s_sub_final[u/(CHAR_BIT*sizeof(long))] >> (u%%(CHAR_BIT*sizeof(long))) & 1 && ret_stack.size()) {\n"
+"    u = ret_stack.back();\n"
+"    ret_stack.pop_back();\n"
+"    goto again;\n"
+"  }", name);
+  fprintf(output, "\n");
+}
+
+static string action_code(Action* action)
+{
+  if (auto t = dynamic_cast<InlineAction*>(action))
+    return t->code;
+  else if (auto t = dynamic_cast<RefAction*>(action))
+    return t->define_stmt->code;
+  else
+    assert(0);
+  return string();
+}
+
+// group edges by destination and collect associated actions
+static void collect_cases(DefineStmt* stmt, vector<Cases>& cases)
+{
+  FsaAnno& anno = compiled[stmt];
   auto find_within = [&](long u) {
     vector<pair<Expr*, ExprTag>> within;
     Expr* last = NULL;
-    sort(ALL(anno.assoc[u]), [](const pair<Expr*, ExprTag>& x, const pair<Expr*, ExprTag>& y) {
+    AssocSet as = assoc_set(anno.assoc[u]);
+    sort(ALL(as), [](const pair<Expr*, ExprTag>& x, const pair<Expr*, ExprTag>& y) {
       if (x.first->pre != y.first->pre)
         return x.first->pre < y.first->pre;
       return x.second < y.second;
     });
-    for (auto aa: anno.assoc[u]) {
+    for (auto aa: as) {
       Expr* stop = last ? find_lca(last, aa.first) : NULL;
       last = aa.first;
       for (Expr* x = aa.first; x != stop; x = x->anc[0])
@@ -226,20 +714,10 @@ void generate_transitions(DefineStmt* stmt)
     within.erase(j, within.end());
     return within;
   };
-  decltype(anno.assoc) withins(anno.fsa.n());
-  REP(i, anno.fsa.n())
+  vector<AssocSet> withins(anno.dfa.n());
+  REP(i, anno.dfa.n())
     withins[i] = move(find_within(i));
 
-  auto get_code = [](Action* action) {
-    if (auto t = dynamic_cast<InlineAction*>(action))
-      return t->code;
-    else if (auto t = dynamic_cast<RefAction*>(action))
-      return t->define_stmt->code;
-    else
-      assert(0);
-    return string();
-  };
-
 #define D(S) if (opt_dump_action) { \
                if (auto t = dynamic_cast<InlineAction*>(action.first)) { \
                  if (from == to-1) \
@@ -254,63 +732,15 @@ void generate_transitions(DefineStmt* stmt)
                } \
              }
 
-  if (output_header) {
-    if (opt_gen_c) {
-      if (opt_gen_extern_c)
-        fputs("extern \"C\" ", output_header);
-      fprintf(output_header, "long yanshi_%s_transit(long* ret_stack, long* ret_stack_len, long u, long c", stmt->lhs.c_str());
-    }
-    else
-      fprintf(output_header, "long yanshi_%s_transit(vector<long>& ret_stack, long u, long c", stmt->lhs.c_str());
-    if (stmt->export_params.size())
-      fprintf(output_header, ", %s", stmt->export_params.c_str());
-    fprintf(output_header, ");\n");
-  }
-  if (opt_gen_c) {
-    if (opt_gen_extern_c)
-      fputs("extern \"C\" ", output);
-    fprintf(output, "long yanshi_%s_transit(long* ret_stack, long* ret_stack_len, long u, long c", stmt->lhs.c_str());
-  }
-  else
-    fprintf(output, "long yanshi_%s_transit(vector<long>& ret_stack, long u, long c", stmt->lhs.c_str());
-  if (stmt->export_params.size())
-    fprintf(output, ", %s", stmt->export_params.c_str());
-fprintf(output,
-")\n"
-"{\n"
-"  long v = -1;\n"
-"again:\n"
-"  switch (u) {\n");
-  REP(u, anno.fsa.n()) {
-    if (call_addr[u].first >= 0) { // no other transitions
-      fprintf(output,
-"  case %ld:\n"
-"    u = %ld;\n"
-, u, call_addr[u].first);
-      if (opt_gen_c)
-        fprintf(output,
-"    if (*ret_stack_len >= %ld) return -1;\n"
-"    ret_stack[(*ret_stack_len)++] = %ld;\n"
-, opt_max_return_stack, call_addr[u].second);
-      else
-        fprintf(output,
-"    ret_stack.push_back(%ld);\n"
-, call_addr[u].second);
-      fprintf(output,
-"    goto again;\n");
-      continue;
-    }
-    if (anno.fsa.adj[u].empty() && ! sub_final[u])
+  auto& call_addr = stmt2call_addr[stmt];
+  cases.assign(anno.dfa.n(), Cases());
+  REP(u, anno.dfa.n()) {
+    if (call_addr[u].first >= 0)
       continue;
-    indent(output, 1);
-    fprintf(output, "case %ld:\n", u);
-    indent(output, 2);
-    fprintf(output, "switch (c) {\n");
-
-    unordered_map<long, pair<vector<pair<long, long>>, vector<pair<Action*, long>>>> v2case;
-    for (auto it = anno.fsa.adj[u].begin(); it != anno.fsa.adj[u].end(); ) {
+    Cases& v2case = cases[u];
+    for (auto it = anno.dfa.adj(u).begin(); it != anno.dfa.adj(u).end(); ) {
       long from = it->first.first, to = it->first.second, v = it->second;
-      while (++it != anno.fsa.adj[u].end() && to == it->first.first && it->second == v)
+      while (++it != anno.dfa.adj(u).end() && to == it->first.first && it->second == v)
         to = it->first.second;
       v2case[v].first.emplace_back(from, to);
       auto& body = v2case[v].second;
@@ -361,90 +791,152 @@ fprintf(output,
           }
       }
     }
+#undef D
 
+    // actions
     for (auto& x: v2case) {
-      for (auto& y: x.second.first) {
-        indent(output, 2);
-        if (y.first == y.second-1)
-          fprintf(output, "case %ld:\n", y.first);
-        else
-          fprintf(output, "case %ld ... %ld:\n", y.first, y.second-1);
-      }
-      indent(output, 3);
-      fprintf(output, "v = %ld;\n", x.first);
-
-      // actions
       sort(ALL(x.second.second), [](const pair<Action*, long>& a0, const pair<Action*, long>& a1) {
         return a0.second != a1.second ? a0.second < a1.second : a0.first < a1.first;
       });
       x.second.second.erase(unique(ALL(x.second.second)), x.second.second.end());
-      for (auto a: x.second.second)
-        fprintf(output, "{%s}\n", get_code(a.first).c_str());
-      indent(output, 3);
-      fprintf(output, "break;\n");
-    }
-    // return from finals of DefineStmt called by CallExpr
-    if (sub_final[u]) {
-      indent(output, 2);
-      fprintf(output, "default:\n");
-      indent(output, 3);
-      fprintf(output, opt_gen_c ?
-"if (*ret_stack_len) { u = ret_stack[--*ret_stack_len]; goto again; }\n"
-:
-"if (ret_stack.size()) { u = ret_stack.back(); ret_stack.pop_back(); goto again; }\n");
-      indent(output, 3);
-      fprintf(output, "break;\n");
     }
+  }
+}
 
-    indent(output, 2);
-    fprintf(output, "}\n");
-    indent(output, 2);
-    fprintf(output, "break;\n");
+void generate_transitions(DefineStmt* stmt)
+{
+  vector<Cases> cases;
+  collect_cases(stmt, cases);
+  Table table;
+  if (opt_backend == Backend::table) {
+    build_table(stmt, cases, table);
+    generate_table_data(stmt, table);
   }
-  indent(output, 1);
-  fprintf(output, "}\n");
-  indent(output, 1);
-  fprintf(output, "return v;\n");
-  fprintf(output, "}\n\n");
+  auto generate_body = [&](const char* dead) {
+    if (opt_backend == Backend::table)
+      generate_table_body(stmt, table, action_code, dead);
+    else
+      generate_switch_body(stmt, cases, action_code, dead);
+  };
+  const char* name = stmt->lhs.c_str();
+  auto print_signature = [&](FILE* out, const char* suffix) {
+    if (opt_gen_c) {
+      if (opt_gen_extern_c)
+        fputs("extern \"C\" ", out);
+      fprintf(out, "long yanshi_%s_transit(long* ret_stack, long* ret_stack_len, long u, long c", name);
+    }
+    else
+      fprintf(out, "long yanshi_%s_transit(vector<long>& ret_stack, long u, long c", name);
+    if (stmt->export_params.size())
+      fprintf(out, ", %s", stmt->export_params.c_str());
+    fprintf(out, ")%s", suffix);
+  };
+  auto print_exec_signature = [&](FILE* out, const char* suffix) {
+    if (opt_gen_c) {
+      if (opt_gen_extern_c)
+        fputs("extern \"C\" ", out);
+      fprintf(out, "const uint8_t* yanshi_%s_exec(long* ret_stack, long* ret_stack_len, long* state, const uint8_t* p, const uint8_t* pe", name);
+    }
+    else
+      fprintf(out, "const uint8_t* yanshi_%s_exec(vector<long>& ret_stack, long* state, const uint8_t* p, const uint8_t* pe", name);
+    if (stmt->export_params.size())
+      fprintf(out, ", %s", stmt->export_params.c_str());
+    fprintf(out, ")%s", suffix);
+  };
+  if (output_header) {
+    print_signature(output_header, ";\n");
+    print_exec_signature(output_header, ";\n");
+  }
+
+  // yanshi_%s_transit: one symbol per call
+  print_signature(output, "\n");
+  fprintf(output,
+"{\n"
+"  long %sv = -1;\n"
+"again:\n", opt_backend == Backend::table ? "i, k, " : "");
+  generate_body("return -1;");
+  fprintf(output,
+"  return v;\n"
+"}\n\n");
+
+  // yanshi_%s_exec: consume [p, pe) until the automaton dies.
+  // Returns the stop position; *state becomes -1 if the symbol at the stop position has no transition.
+  // In UTF-8 mode an incomplete sequence at the end stops the loop with *state still alive.
+  print_exec_signature(output, "\n");
+  fprintf(output,
+"{\n"
+"  long %su = *state, v, c;\n", opt_backend == Backend::table ? "i, k, " : "");
+  if (opt_bytes || opt_utf8)
+    fprintf(output,
+"  for (; p < pe; p++) {\n"
+"    c = *p;\n");
+  else
+    fprintf(output,
+"  const uint8_t* q;\n"
+"  for (; p < pe; p = q) {\n"
+"    if ((q = yanshi_utf8_decode(p, pe, &c)) == p) break;\n");
+  fprintf(output,
+"    v = -1;\n"
+"again:\n");
+  generate_body("goto dead;");
+  fprintf(output,
+"    if (v < 0) goto dead;\n"
+"    u = v;\n"
+"  }\n"
+"  *state = u;\n"
+"  return p;\n"
+"dead:\n"
+"  *state = -1;\n"
+"  return p;\n"
+"}\n\n");
 }
 
-bool compile_export(DefineStmt* stmt)
+// Coalesce DefineStmt associated to referenced CallExpr/CollapseExpr, determinize and minimize
+static bool construct_export(DefineStmt* stmt, vector<bool>& sub_final, unordered_map<DefineStmt*, long>& stmt2start, long jobs, Profiler& prof)
 {
-  DP(2, "Exporting %s", stmt->lhs.c_str());
-  FsaAnno& anno = compiled[stmt];
+  FsaAnno& anno = compiled.at(stmt);
+  expanding = {stmt, NULL};
+  fsa_limit_context = &expanding;
+
+  prof.begin("merge");
 
   DP(3, "Construct automaton with all DefineStmt associated to referenced CallExpr/CollapseExpr");
   vector<vector<Edge>> adj;
+  vector<vector<long>> eps;
   decltype(anno.assoc) assoc;
   vector<vector<DefineStmt*>> cllps;
   long allo = 0;
   unordered_map<DefineStmt*, long> stmt2offset;
-  unordered_map<DefineStmt*, long> stmt2start;
+  unordered_map<DefineStmt*, const Fsa*> stmt2fsa;
+  unordered_map<DefineStmt*, Fsa> thawed;
   unordered_map<long, DefineStmt*> start2stmt;
   vector<long> starts;
-  vector<bool> sub_final;
   function<void(DefineStmt*)> allocate = [&](DefineStmt* stmt) {
     if (stmt2offset.count(stmt))
       return;
     DP(4, "Allocate %ld to %s", allo, stmt->lhs.c_str());
-    FsaAnno& anno = compiled[stmt];
+    FsaAnno& anno = compiled.at(stmt);
+    if (anno.dfa.n()) // a preceding export
+      thawed[stmt] = anno.dfa.thaw();
+    const Fsa& fsa = *(stmt2fsa[stmt] = anno.dfa.n() ? &thawed[stmt] : &anno.fsa);
     long base = stmt2offset[stmt] = allo;
-    allo += anno.fsa.n();
+    allo += fsa.n();
     sub_final.resize(allo);
+    eps.resize(allo);
     if (used_as_call.count(stmt)) {
-      stmt2start[stmt] = base+anno.fsa.start;
-      start2stmt[base+anno.fsa.start] = stmt;
-      starts.push_back(base+anno.fsa.start);
-      for (long f: anno.fsa.finals)
+      stmt2start[stmt] = base+fsa.start;
+      start2stmt[base+fsa.start] = stmt;
+      starts.push_back(base+fsa.start);
+      for (long f: fsa.finals)
         sub_final[base+f] = true;
     }
-    adj.insert(adj.end(), ALL(anno.fsa.adj));
-    REP(i, anno.fsa.n())
+    adj.insert(adj.end(), ALL(fsa.adj));
+    REP(i, fsa.n())
       for (auto& e: adj[base+i])
         e.second += base;
     assoc.insert(assoc.end(), ALL(anno.assoc));
-    FOR(i, base, base+anno.fsa.n()) {
-      for (auto aa: assoc[i])
+    FOR(i, base, base+fsa.n()) {
+      for (auto aa: assoc_set(assoc[i]))
         if (has_start(aa.second)) {
           if (auto* e = dynamic_cast<CallExpr*>(aa.first)) {
             DefineStmt* v = e->define_stmt;
@@ -453,7 +945,7 @@ bool compile_export(DefineStmt* stmt)
             DefineStmt* v = e->define_stmt;
             allocate(v);
             // (i@{CollapseExpr,...}, special, _) -> ({CollapseExpr,...}, epsilon, CollapseExpr.define_stmt.start)
-            sorted_emplace(adj[i], epsilon, stmt2offset[v]+compiled[v].fsa.start);
+            eps[i].push_back(stmt2offset[v]+stmt2fsa[v]->start);
           }
         }
       long j = adj[i].size();
@@ -464,17 +956,13 @@ bool compile_export(DefineStmt* stmt)
         else
           j--;
         CollapseExpr* e;
-        for (auto aa: assoc[v])
+        for (auto aa: assoc_set(assoc[v]))
           if (has_final(aa.second) && (e = dynamic_cast<CollapseExpr*>(aa.first))) {
             DefineStmt* w = e->define_stmt;
             allocate(w);
             // (_, special, v@{CollapseExpr,...}) -> (CollapseExpr.define_stmt.final, epsilon, v)
-            for (long f: compiled[w].fsa.finals) {
-              long g = stmt2offset[w]+f;
-              sorted_emplace(adj[g], epsilon, v);
-              if (g == i)
-                j++;
-            }
+            for (long f: stmt2fsa[w]->finals)
+              eps[stmt2offset[w]+f].push_back(v);
           }
       }
       // remove (i, special, _)
@@ -483,6 +971,7 @@ bool compile_export(DefineStmt* stmt)
   };
   allocate(stmt);
   anno.fsa.adj = move(adj);
+  anno.fsa.eps = move(eps);
   anno.assoc = move(assoc);
   anno.deterministic = false;
   DP(3, "# of states: %ld", anno.fsa.n());
@@ -490,13 +979,20 @@ bool compile_export(DefineStmt* stmt)
   // substring grammar & this nonterminal is not marked as intact
   if (opt_substring_grammar && ! stmt->intact) {
     DP(3, "Constructing substring grammar");
+    prof.begin("substring_grammar");
     anno.substring_grammar();
+    sub_final.resize(anno.fsa.n());
     DP(3, "# of states: %ld", anno.fsa.n());
   }
 
+  vector<long> scale;
+  anno.fsa.compress_labels(scale);
+  DP(3, "# of label classes: %zd", scale.size()-1);
+
   vector<vector<long>> map0;
   DP(3, "Determinize");
-  anno.determinize(&starts, &map0);
+  prof.begin("determinize");
+  anno.determinize(&starts, &map0, jobs);
   vector<bool> sub_final2(anno.fsa.n());
   REP(i, anno.fsa.n())
     for (long u: map0[i]) {
@@ -520,6 +1016,7 @@ bool compile_export(DefineStmt* stmt)
   DP(3, "# of states: %ld", anno.fsa.n());
 
   DP(3, "Minimize");
+  prof.begin("minimize");
   map0.clear();
   anno.minimize(&map0);
   sub_final2.assign(anno.fsa.n(), false);
@@ -536,18 +1033,47 @@ bool compile_export(DefineStmt* stmt)
   start2stmt.clear();
   for (auto& it: stmt2start)
     start2stmt[it.second] = it.first;
+  anno.fsa.decompress_labels(scale);
+  prof.end();
   DP(3, "# of states: %ld", anno.fsa.n());
+  return true;
+}
+
+bool compile_export(DefineStmt* stmt, long jobs)
+{
+  DP(2, "Exporting %s", stmt->lhs.c_str());
+  FsaAnno& anno = compiled.at(stmt);
+  Profiler prof(stmt, "export", anno);
+
+  vector<bool> sub_final;
+  unordered_map<DefineStmt*, long> stmt2start;
+  if (opt_cache_dir)
+    prof.begin("cache_load");
+  if (! (opt_cache_dir && cache_load_export(stmt, anno, sub_final, stmt2start))) {
+    if (! construct_export(stmt, sub_final, stmt2start, jobs, prof))
+      return false;
+    if (opt_cache_dir) {
+      prof.begin("cache_save");
+      cache_save_export(stmt, anno, sub_final, stmt2start);
+    }
+  }
+  anno.freeze();
+  vector<bool> sub_final2;
+  unordered_map<long, DefineStmt*> start2stmt;
+  for (auto& it: stmt2start)
+    start2stmt[it.second] = it.first;
 
   if (! opt_keep_inaccessible) {
     DP(3, "Keep accessible states");
+    prof.begin("accessible");
     // roots: start, starts of DefineStmt associated to CallExpr
-    starts.clear();
+    vector<long> starts;
     for (auto& it: stmt2start)
       starts.push_back(it.second);
     vector<long> map1;
     anno.accessible(&starts, map1);
-    sub_final2.assign(anno.fsa.n(), false);
-    REP(i, anno.fsa.n()) {
+    sub_final2.assign(anno.dfa.n(), false);
+    REP(i, anno.dfa.n()) {
       long u = map1[i];
       sub_final2[i] = sub_final[u];
       if (start2stmt.count(u))
@@ -557,14 +1083,15 @@ bool compile_export(DefineStmt* stmt)
     start2stmt.clear();
     for (auto& it: stmt2start)
       start2stmt[it.second] = it.first;
-    DP(3, "# of states: %ld", anno.fsa.n());
+    DP(3, "# of states: %ld", anno.dfa.n());
 
     DP(3, "Keep co-accessible states");
+    prof.begin("co_accessible");
     // roots: finals, finals of DefineStmt associated to CallExpr
     map1.clear();
     anno.co_accessible(&sub_final, map1);
-    sub_final2.assign(anno.fsa.n(), false);
-    REP(i, anno.fsa.n()) {
+    sub_final2.assign(anno.dfa.n(), false);
+    REP(i, anno.dfa.n()) {
       long u = map1[i];
       sub_final2[i] = sub_final[u];
       if (start2stmt.count(u))
@@ -574,45 +1101,65 @@ bool compile_export(DefineStmt* stmt)
     start2stmt.clear();
     for (auto& it: stmt2start)
       start2stmt[it.second] = it.first;
-    DP(3, "# of states: %ld", anno.fsa.n());
+    prof.end();
+    DP(3, "# of states: %ld", anno.dfa.n());
   }
 
   stmt2final[stmt] = sub_final;
   auto& call_addr = stmt2call_addr[stmt];
-  call_addr.assign(anno.fsa.n(), make_pair(-1L, -1L));
+  call_addr.assign(anno.dfa.n(), make_pair(-1L, -1L));
   DP(3, "CallExpr");
-  REP(i, anno.fsa.n())
-    if (anno.fsa.has_call(i)) {
-      if (anno.fsa.adj[i].size() != 1 || anno.fsa.adj[i][0].first.second-anno.fsa.adj[i][0].first.first > 1) {
+  REP(i, anno.dfa.n())
+    if (anno.dfa.has_call(i)) {
+      if (anno.dfa.adj(i).size() != 1 || anno.dfa.adj(i)[0].first.second-anno.dfa.adj(i)[0].first.first > 1) {
         stmt->module->locfile.error_context(stmt->loc, "state %ld: CallExpr cannot coexist with other transitions", i);
-        for (auto it = anno.fsa.adj[i].begin(); it != anno.fsa.adj[i].end(); ) {
+        for (auto it = anno.dfa.adj(i).begin(); it != anno.dfa.adj(i).end(); ) {
           long from = it->first.first, to = it->first.second, v = it->second;
-          while (++it != anno.fsa.adj[i].end() && to == it->first.first && it->second == v)
+          while (++it != anno.dfa.adj(i).end() && to == it->first.first && it->second == v)
             to = it->first.second;
           fprintf(stderr, "  (%ld,%ld)\n", from, to-1);
         }
         return false;
       }
-      for (auto aa: anno.assoc[i])
+      for (auto aa: assoc_set(anno.assoc[i]))
         if (has_start(aa.second))
           if (auto* e = dynamic_cast<CallExpr*>(aa.first)) // unique
-            call_addr[i] = {stmt2start[e->define_stmt], anno.fsa.adj[i][0].second};
+            call_addr[i] = {stmt2start[e->define_stmt], anno.dfa.adj(i)[0].second};
     }
 
   DP(3, "Removing action/CallExpr labels");
-  REP(i, anno.fsa.n()) {
-    long j = anno.fsa.adj[i].size();
-    while (j && action_label_base < anno.fsa.adj[i][j-1].first.second)
-      if (anno.fsa.adj[i][j-1].first.first < action_label_base)
-        anno.fsa.adj[i][j-1].first.second = action_label_base;
-      else
-        j--;
-    anno.fsa.adj[i].resize(j);
-  }
+  anno.dfa = anno.dfa.truncate_labels(action_label_base);
 
   return true;
 }
 
+// compile_export reads compiled[] of the DefineStmt it references and replaces its own entry,
+// so an export waits for the preceding exports it references or which reference it. Others run concurrently.
+long compile_exports(const vector<DefineStmt*>& exports)
+{
+  long n = exports.size();
+  vector<vector<DefineStmt*>> reach(n);
+  vector<vector<long>> succ(n);
+  REP(i, n) {
+    stmt2call_addr[exports[i]];
+    stmt2final[exports[i]];
+    reach[i] = reachable_define_stmts(exports[i], true);
+    sort(ALL(reach[i]));
+  }
+  REP(j, n)
+    REP(i, j)
+      if (binary_search(ALL(reach[j]), exports[i]) || binary_search(ALL(reach[i]), exports[j]))
+        succ[i].push_back(j);
+  // split threads between exports and their determinization
+  long jobs = max(1L, min(opt_jobs, n));
+  atomic<long> n_errors(0);
+  run_dag(succ, jobs, [&](long i) {
+    if (! compile_export(exports[i], max(1L, opt_jobs/jobs)))
+      n_errors++;
+  });
+  return n_errors;
+}
+
 //// Graphviz dot renderer
 
 void generate_graphviz(Module* mo)
@@ -629,8 +1176,8 @@ void generate_graphviz(Module* mo)
         // finals
         indent(output, 1);
         fprintf(output, "node[shape=doublecircle,color=olivedrab1,style=filled,fontname=Monospace];");
-        for (long f: anno.fsa.finals)
-          if (f == anno.fsa.start)
+        for (long f: anno.dfa.finals)
+          if (f == anno.dfa.start)
             start_is_final = true;
           else
             fprintf(output, " %ld", f);
@@ -642,18 +1189,18 @@ void generate_graphviz(Module* mo)
           fprintf(output, "node[shape=doublecircle,color=orchid];");
         else
           fprintf(output, "node[shape=circle,color=orchid];");
-        fprintf(output, " %ld\n", anno.fsa.start);
+        fprintf(output, " %ld\n", anno.dfa.start);
 
         // other states
         indent(output, 1);
         fprintf(output, "node[shape=circle,color=black,style=\"\"]\n");
 
         // edges
-        REP(u, anno.fsa.n()) {
+        REP(u, anno.dfa.n()) {
           unordered_map<long, stringstream> labels;
           bool first = true;
-          auto it = anno.fsa.adj[u].begin();
-          for (; it != anno.fsa.adj[u].end(); ++it) {
+          auto it = anno.dfa.adj(u).begin();
+          for (; it != anno.dfa.adj(u).end(); ++it) {
             stringstream& lb = labels[it->second];
             if (! lb.str().empty())
               lb << ',';
@@ -672,6 +1219,136 @@ void generate_graphviz(Module* mo)
   fprintf(output, "}\n");
 }
 
+//// Binary
+
+// Sections of the --emit-binary file, each 8-byte aligned
+struct BinaryBuffer {
+  string buf;
+  u64 reserve(size_t n) {
+    buf.resize((buf.size()+7) & -8);
+    u64 off = buf.size();
+    buf.resize(off+n);
+    return off;
+  }
+  u64 put(const void* data, size_t n) {
+    u64 off = reserve(n);
+    memcpy(&buf[off], data, n);
+    return off;
+  }
+  template<class T>
+  u64 put(const vector<T>& a) {
+    return put(a.data(), a.size()*sizeof(T));
+  }
+};
+
+static vector<u64> bitmap(const vector<bool>& a)
+{
+  vector<u64> r((a.size()+63)/64, 0);
+  REP(i, a.size())
+    if (a[i])
+      r[i/64] |= u64(1) << i%64;
+  return r;
+}
+
+void generate_binary(Module* mo)
+{
+  vector<DefineStmt*> exports;
+  for (Stmt* x = mo->toplevel; x; x = x->next)
+    if (auto stmt = dynamic_cast<DefineStmt*>(x))
+      if (stmt->export_)
+        exports.push_back(stmt);
+
+  BinaryBuffer b;
+  string strings;
+  auto add_string = [&](const string& x) {
+    u64 off = strings.size();
+    strings += x;
+    strings += '\0';
+    return off;
+  };
+  yanshi_bin_header h;
+  memset(&h, 0, sizeof h);
+  b.reserve(sizeof h);
+  vector<yanshi_bin_automaton> automata(exports.size());
+  h.automata = b.reserve(sizeof(yanshi_bin_automaton)*exports.size());
+
+  REP(i, exports.size()) {
+    DefineStmt* stmt = exports[i];
+    FsaAnno& anno = compiled[stmt];
+    Profiler prof(stmt, "export", anno);
+    prof.begin("codegen");
+    auto& call_addr = stmt2call_addr[stmt];
+    yanshi_bin_automaton& a = automata[i];
+    vector<Cases> cases;
+    collect_cases(stmt, cases);
+
+    vector<int64_t> edge_offset{0}, action_offset{0}, action_ids;
+    vector<yanshi_bin_edge> edges;
+    vector<yanshi_bin_call> calls(anno.dfa.n());
+    vector<u64> codes;
+    unordered_map<Action*, long> action2id;
+    bool has_call = false;
+    REP(u, anno.dfa.n()) {
+      calls[u] = {call_addr[u].first, call_addr[u].second};
+      if (call_addr[u].first >= 0)
+        has_call = true;
+      vector<pair<yanshi_bin_edge, const vector<pair<Action*, long>>*>> es;
+      for (auto& x: cases[u])
+        for (auto& y: x.second.first)
+          es.push_back({yanshi_bin_edge{y.first, y.second, x.first}, &x.second.second});
+      sort(ALL(es), [](const pair<yanshi_bin_edge, const vector<pair<Action*, long>>*>& x, const pair<yanshi_bin_edge, const vector<pair<Action*, long>>*>& y) {
+        return x.first.from < y.first.from;
+      });
+      for (auto& e: es) {
+        edges.push_back(e.first);
+        for (auto& action: *e.second) {
+          auto it = action2id.find(action.first);
+          if (it == action2id.end()) {
+            it = action2id.emplace(action.first, codes.size()).first;
+            codes.push_back(add_string(action_code(action.first)));
+          }
+          action_ids.push_back(it->second);
+        }
+        action_offset.push_back(action_ids.size());
+      }
+      edge_offset.push_back(edges.size());
+    }
+
+    vector<bool> final(anno.dfa.n());
+    for (long f: anno.dfa.finals)
+      final[f] = true;
+    a.name = add_string(stmt->lhs);
+    a.start = anno.dfa.start;
+    a.n_states = anno.dfa.n();
+    a.n_edges = edges.size();
+    a.edge_offset = b.put(edge_offset);
+    a.edges = b.put(edges);
+    a.final = b.put(bitmap(final));
+    a.sub_final = b.put(bitmap(stmt2final[stmt]));
+    a.calls = has_call ? b.put(calls) : 0;
+    if (action_ids.size()) {
+      a.action_offset = b.put(action_offset);
+      a.action_ids = b.put(action_ids);
+      a.n_actions = codes.size();
+      a.action_code = b.put(codes);
+    }
+  }
+
+  memcpy(h.magic, YANSHI_BIN_MAGIC, sizeof h.magic);
+  h.version = YANSHI_BIN_VERSION;
+  h.input = opt_bytes ? YANSHI_BIN_BYTES : opt_utf8 ? YANSHI_BIN_UTF8 : YANSHI_BIN_CODEPOINTS;
+  h.max_return_stack = opt_max_return_stack;
+  h.n_automata = exports.size();
+  h.strings = b.put(strings.data(), strings.size());
+  h.strings_size = strings.size();
+  b.reserve(0);
+  h.size = b.buf.size();
+  memcpy(&b.buf[0], &h, sizeof h);
+  if (automata.size())
+    memcpy(&b.buf[h.automata], automata.data(), sizeof(yanshi_bin_automaton)*automata.size());
+  fwrite(b.buf.data(), 1, b.buf.size(), output);
+}
+
 //// C++ renderer
 
 static void generate_final(const char* name, const vector<bool>& final)
@@ -701,14 +1378,164 @@ static void generate_final(const char* name, const vector<bool>& final)
   fprintf(output, "};\n");
 }
 
+// Extract parameter names from `export_params` to forward them. Fails on unnamed parameters.
+static bool param_names(const string& params, string& names)
+{
+  vector<string> segs(1);
+  long depth = 0;
+  for (char c: params) {
+    if (c == '(' || c == '[' || c == '{' || c == '<') depth++;
+    else if (c == ')' || c == ']' || c == '}' || c == '>') depth--;
+    if (c == ',' && ! depth)
+      segs.emplace_back();
+    else
+      segs.back() += c;
+  }
+  auto is_ident = [](char c) { return isalnum(c) || c == '_'; };
+  names.clear();
+  for (auto& seg: segs) {
+    string::size_type i, j;
+    if ((i = seg.find('=')) != string::npos)
+      seg.erase(i);
+    if ((i = seg.find("(*")) != string::npos || (i = seg.find("(&")) != string::npos) {
+      // pointer/reference to function or array
+      for (i += 2; i < seg.size() && isspace(seg[i]); i++);
+      for (j = i; j < seg.size() && is_ident(seg[j]); j++);
+    } else {
+      depth = 0;
+      for (j = seg.size(); j > 0 && (depth || isspace(seg[j-1]) || seg[j-1] == ']'); j--)
+        if (seg[j-1] == ']') depth++;
+        else if (seg[j-1] == '[') depth--;
+      for (i = j; i > 0 && is_ident(seg[i-1]); i--);
+      // the name should follow a type
+      if (seg.find_first_not_of(" \t\n", 0) == i)
+        return false;
+    }
+    if (i == j || isdigit(seg[i]))
+      return false;
+    if (names.size())
+      names += ", ";
+    names += seg.substr(i, j-i);
+  }
+  return true;
+}
+
+// yanshi_%s_ctx: resumable matcher for chunked input
+static void generate_ctx(DefineStmt* stmt)
+{
+  const char* name = stmt->lhs.c_str();
+  string args;
+  if (stmt->export_params.size()) {
+    if (! param_names(stmt->export_params, args)) {
+      stmt->module->locfile.warning(stmt->loc, "cannot extract parameter names, yanshi_%s_ctx is not generated", name);
+      return;
+    }
+    args = ", "+args;
+  }
+  string params = stmt->export_params.size() ? ", "+stmt->export_params : "";
+  for (FILE* out: {output_header, output}) {
+    if (! out) continue;
+    if (opt_gen_c)
+      fprintf(out,
+"typedef struct {\n"
+"  long u, ret_stack[%ld], ret_stack_len;\n"
+, opt_max_return_stack);
+    else
+      fprintf(out,
+"struct yanshi_%s_ctx {\n"
+"  long u;\n"
+"  vector<long> ret_stack;\n"
+, name);
+    if (! (opt_bytes || opt_utf8))
+      fprintf(out,
+"  uint8_t partial[4]; // incomplete UTF-8 sequence at the end of the last chunk\n"
+"  long partial_len;\n");
+    if (opt_gen_c)
+      fprintf(out, "} yanshi_%s_ctx;\n", name);
+    else
+      fprintf(out, "};\n");
+    if (out == output)
+      break;
+    fputs(opt_gen_extern_c ? "extern \"C\" " : "", out);
+    fprintf(out, "void yanshi_%s_init(yanshi_%s_ctx* ctx);\n", name, name);
+    fputs(opt_gen_extern_c ? "extern \"C\" " : "", out);
+    fprintf(out, "const uint8_t* yanshi_%s_feed(yanshi_%s_ctx* ctx, const uint8_t* p, const uint8_t* pe%s);\n", name, name, params.c_str());
+    fputs(opt_gen_extern_c ? "extern \"C\" " : "", out);
+    fprintf(out, "bool yanshi_%s_finish(yanshi_%s_ctx* ctx%s);\n", name, name, params.c_str());
+  }
+  const char* rs = opt_gen_c ? "ctx->ret_stack, &ctx->ret_stack_len" : "ctx->ret_stack";
+
+  fputs(opt_gen_extern_c ? "extern \"C\" " : "", output);
+  fprintf(output,
+"void yanshi_%s_init(yanshi_%s_ctx* ctx)\n"
+"{\n"
+"  ctx->u = yanshi_%s_start;\n"
+"  %s;\n"
+, name, name, name, opt_gen_c ? "ctx->ret_stack_len = 0" : "ctx->ret_stack.clear()");
+  if (! (opt_bytes || opt_utf8))
+    fprintf(output, "  ctx->partial_len = 0;\n");
+  fprintf(output, "}\n\n");
+
+  // Returns pe if the whole chunk is accepted, otherwise the start of the symbol without a transition
+  // (the chunk start if the symbol began in a previous chunk). ctx->u stays -1 afterwards.
+  fputs(opt_gen_extern_c ? "extern \"C\" " : "", output);
+  fprintf(output,
+"const uint8_t* yanshi_%s_feed(yanshi_%s_ctx* ctx, const uint8_t* p, const uint8_t* pe%s)\n"
+"{\n"
+"  if (ctx->u < 0) return p;\n"
+, name, name, params.c_str());
+  if (opt_bytes || opt_utf8)
+    fprintf(output,
+"  return yanshi_%s_exec(%s, &ctx->u, p, pe%s);\n"
+, name, rs, args.c_str());
+  else
+    fprintf(output,
+"  const uint8_t *p0 = p, *q;\n"
+"  long i;\n"
+"  while (ctx->partial_len && p < pe) {\n"
+"    ctx->partial[ctx->partial_len++] = *p++;\n"
+"    q = yanshi_%s_exec(%s, &ctx->u, ctx->partial, ctx->partial+ctx->partial_len%s);\n"
+"    if (ctx->u < 0) return p0;\n"
+"    ctx->partial_len -= q-ctx->partial;\n"
+"    for (i = 0; i < ctx->partial_len; i++)\n"
+"      ctx->partial[i] = q[i];\n"
+"  }\n"
+"  p = yanshi_%s_exec(%s, &ctx->u, p, pe%s);\n"
+"  if (ctx->u < 0) return p;\n"
+"  while (p < pe)\n"
+"    ctx->partial[ctx->partial_len++] = *p++;\n"
+"  return p;\n"
+, name, rs, args.c_str(), name, rs, args.c_str());
+  fprintf(output, "}\n\n");
+
+  // An incomplete UTF-8 sequence at the end of input is treated as U+FFFD.
+  fputs(opt_gen_extern_c ? "extern \"C\" " : "", output);
+  fprintf(output,
+"bool yanshi_%s_finish(yanshi_%s_ctx* ctx%s)\n"
+"{\n"
+, name, name, params.c_str());
+  if (! (opt_bytes || opt_utf8))
+    fprintf(output,
+"  if (ctx->partial_len && ctx->u >= 0)\n"
+"    ctx->u = yanshi_%s_transit(%s, ctx->u, 0xfffd%s);\n"
+"  ctx->partial_len = 0;\n"
+, name, rs, args.c_str());
+  fprintf(output,
+"  return yanshi_%s_is_final(%s, ctx->u);\n"
+"}\n\n"
+, name, opt_gen_c ? "ctx->ret_stack, ctx->ret_stack_len" : "ctx->ret_stack");
+}
+
 static void generate_cxx_export(DefineStmt* stmt)
 {
   FsaAnno& anno = compiled[stmt];
+  Profiler prof(stmt, "export", anno);
+  prof.begin("codegen");
 
   // yanshi_%s_init
   if (output_header)
     fprintf(output_header, "extern long yanshi_%s_start;\n", stmt->lhs.c_str());
-  fprintf(output, "long yanshi_%s_start = %ld;\n\n", stmt->lhs.c_str(), anno.fsa.start);
+  fprintf(output, "long yanshi_%s_start = %ld;\n\n", stmt->lhs.c_str(), anno.dfa.start);
 
   // yanshi_%s_is_final
   if (output_header) {
@@ -726,8 +1553,8 @@ static void generate_cxx_export(DefineStmt* stmt)
 "bool yanshi_%s_is_final(const vector<long>& ret_stack, long u)\n"
           , stmt->lhs.c_str());
   fprintf(output, "{\n");
-  vector<bool> final(anno.fsa.n());
-  for (long f: anno.fsa.finals)
+  vector<bool> final(anno.dfa.n());
+  for (long f: anno.dfa.finals)
     final[f] = true;
   generate_final("", final);
   generate_final("sub_", stmt2final[stmt]);
@@ -741,15 +1568,17 @@ static void generate_cxx_export(DefineStmt* stmt)
 "      return false;\n"
 "  return 0 <= u && u < %ld && final[u/(CHAR_BIT*sizeof(long))] >> (u%%(CHAR_BIT*sizeof(long))) & 1;\n"
 "};\n\n"
-, anno.fsa.n() , anno.fsa.n()
+, anno.dfa.n() , anno.dfa.n()
 );
   generate_transitions(stmt);
+  generate_ctx(stmt);
 }
 
 void generate_cxx(Module* mo)
 {
   fprintf(output, "// Generated by 偃师, %s\n", mo->filename.c_str());
   fprintf(output, "#include <limits.h>\n");
+  fprintf(output, "#include <stdint.h>\n");
   if (! opt_gen_c) {
     fprintf(output, "#include <vector>\n");
     fprintf(output, "using namespace std;\n");
@@ -774,6 +1603,7 @@ void generate_cxx(Module* mo)
   }
   if (output_header) {
     fputs("#pragma once\n", output_header);
+    fputs("#include <stdint.h>\n", output_header);
     if (! opt_gen_c) {
       fprintf(output_header, "#include <vector>\n");
       fprintf(output_header, "using std::vector;\n");
@@ -782,6 +1612,27 @@ void generate_cxx(Module* mo)
     }
   }
   fprintf(output, "\n");
+  if (! (opt_bytes || opt_utf8))
+    fputs(
+"// Decode one UTF-8 sequence. Invalid sequences yield U+FFFD; returns p if [p, pe) ends in the middle of a sequence.\n"
+"static inline const uint8_t* yanshi_utf8_decode(const uint8_t* p, const uint8_t* pe, long* c)\n"
+"{\n"
+"  long i, n, x = *p;\n"
+"  if (x < 0x80) { *c = x; return p+1; }\n"
+"  if (x < 0xc2 || x > 0xf4) { *c = 0xfffd; return p+1; }\n"
+"  n = x < 0xe0 ? 1 : x < 0xf0 ? 2 : 3;\n"
+"  x &= 0x3f >> n;\n"
+"  for (i = 1; i <= n; i++) {\n"
+"    if (p+i >= pe) return p;\n"
+"    if ((p[i] & 0xc0) != 0x80) { *c = 0xfffd; return p+i; }\n"
+"    x = x << 6 | (p[i] & 0x3f);\n"
+"  }\n"
+"  if (n == 2 ? x < 0x800 || (0xd800 <= x && x < 0xe000) : n == 3 && (x < 0x10000 || x > 0x10ffff))\n"
+"    x = 0xfffd;\n"
+"  *c = x;\n"
+"  return p+n+1;\n"
+"}\n\n"
+, output);
   DefineStmt* main_export = NULL;
   for (Stmt* x = mo->toplevel; x; x = x->next)
     if (auto xx = dynamic_cast<DefineStmt*>(x)) {
@@ -815,8 +1666,15 @@ void generate_cxx(Module* mo)
 "      utf8 += c;\n"
 "    fclose(f);\n"
 "  }\n"
-"  u32string utf32 = wstring_convert<codecvt_utf8<char32_t>, char32_t>{}.from_bytes(utf8);\n"
 );
+    if (opt_utf8)
+      fprintf(output,
+"  u32string utf32;\n"
+"  for (unsigned char c: utf8)\n"
+"    utf32 += c;\n");
+    else
+      fprintf(output,
+"  u32string utf32 = wstring_convert<codecvt_utf8<char32_t>, char32_t>{}.from_bytes(utf8);\n");
     fprintf(output, opt_gen_c ?
 "  printf(\"\\033[%%s33m%%ld \\033[m\", yanshi_%s_is_final(ret_stack, ret_stack_len, u) ? \"1;\" : \"\", u);\n"
 :
@@ -831,8 +1689,9 @@ void generate_cxx(Module* mo)
 "    u = yanshi_%s_transit(ret_stack, u, c);\n"
 , main_export->lhs.c_str());
     fprintf(output,
-"    if (c > WCHAR_MAX || iswcntrl(c)) printf(\"%%\" PRIuLEAST32 \" \", c);\n"
-"    else cout << wstring_convert<codecvt_utf8<char32_t>, char32_t>{}.to_bytes(c) << ' ';\n");
+"    if (c > %s || iswcntrl(c)) printf(\"%%\" PRIuLEAST32 \" \", c);\n"
+"    else cout << wstring_convert<codecvt_utf8<char32_t>, char32_t>{}.to_bytes(c) << ' ';\n"
+, opt_utf8 ? "0x7f" : "WCHAR_MAX");
     fprintf(output, opt_gen_c ?
 "    printf(\"\\033[%%s33m%%ld \\033[m\", yanshi_%s_is_final(ret_stack, ret_stack_len, u) ? \"1;\" : \"\", u);\n"
 :
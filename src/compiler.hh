@@ -7,8 +7,12 @@ using std::unordered_map;
 
 void print_assoc(const FsaAnno& anno);
 void print_automaton(const Fsa& fsa);
-void compile(DefineStmt*);
-bool compile_export(DefineStmt* stmt);
+void compile(DefineStmt* stmt, long block);
+bool compile_export(DefineStmt* stmt, long jobs);
+long compile_exports(const vector<DefineStmt*>& exports);
+void limit_exceeded(const char* construction, long states, long frontier);
+void generate_binary(Module* mo);
 void generate_cxx(Module* mo);
 void generate_graphviz(Module* mo);
+// every DefineStmt has an entry before the DAG runs; workers use at() so that they never insert
 extern unordered_map<DefineStmt*, FsaAnno> compiled;
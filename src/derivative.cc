@@ -0,0 +1,494 @@
+#include "common.hh"
+#include "compiler.hh"
+#include "derivative.hh"
+#include "fsa_anno.hh"
+#include "option.hh"
+
+#include <algorithm>
+#include <limits.h>
+#include <stack>
+#include <unordered_map>
+using namespace std;
+
+namespace {
+enum class Kind {empty, epsilon, atom, concat, star, repeat, or_, and_, not_};
+
+// atom: {automaton, state}, concat: {lhs, rhs}, star/not_: {inner}, repeat: {inner, low, high},
+// or_/and_: sorted unique operands
+struct Term {
+  Kind kind;
+  vector<long> xs;
+  bool nullable;
+  // derivatives are equal within [bounds[k-1], bounds[k]) and empty outside [bounds[0], bounds.back()).
+  // deriv[k] caches the derivative of that class, -1 if not computed
+  vector<long> bounds, deriv;
+  bool bounded = false;
+};
+
+// Terms are hash-consed and kept in a normal form (flattened, sorted and deduplicated or_/and_, right-nested
+// concat, trivial operands folded), so that similar derivatives are the same term and the DFA is finite.
+// Leaves are the small DFAs built by FsaAnno for BracketExpr, DotExpr, EmbedExpr and LiteralExpr.
+struct Derivatives {
+  enum : long {EMPTY, EPSILON, FULL};
+  vector<Term> terms;
+  vector<u64> hashes;
+  vector<long> slot; // open addressing over `terms`
+  long mask = -1;
+  vector<Fsa> atoms;
+  unordered_map<vector<long>, long, VectorHash> atom_index;
+
+  Derivatives() {
+    intern(Kind::empty, {});
+    intern(Kind::epsilon, {});
+    intern(Kind::not_, {EMPTY});
+  }
+
+  static u64 hash(Kind kind, const vector<long>& xs) {
+    u64 h = long(kind);
+    for (long x: xs) {
+      h = (h ^ u64(x)) * 0x9e3779b97f4a7c15uLL;
+      h ^= h >> 29;
+    }
+    return h;
+  }
+
+  long intern(Kind kind, vector<long> xs) {
+    u64 h = hash(kind, xs);
+    if (2*(terms.size()+1) > mask+1) {
+      mask = mask < 0 ? 63 : 2*mask+1;
+      slot.assign(mask+1, -1);
+      REP(id, terms.size())
+        for (long i = hashes[id] & mask; ; i = (i+1) & mask)
+          if (slot[i] < 0) {
+            slot[i] = id;
+            break;
+          }
+    }
+    long i = h & mask;
+    for (; slot[i] >= 0; i = (i+1) & mask) {
+      long id = slot[i];
+      if (hashes[id] == h && terms[id].kind == kind && terms[id].xs == xs)
+        return id;
+    }
+    bool nullable = false;
+    switch (kind) {
+    case Kind::empty: nullable = false; break;
+    case Kind::epsilon: nullable = true; break;
+    case Kind::atom: nullable = atoms[xs[0]].is_final(xs[1]); break;
+    case Kind::concat: nullable = terms[xs[0]].nullable && terms[xs[1]].nullable; break;
+    case Kind::star: nullable = true; break;
+    case Kind::repeat: nullable = xs[1] == 0 || terms[xs[0]].nullable; break;
+    case Kind::or_:
+      nullable = any_of(ALL(xs), [&](long x) { return terms[x].nullable; });
+      break;
+    case Kind::and_:
+      nullable = all_of(ALL(xs), [&](long x) { return terms[x].nullable; });
+      break;
+    case Kind::not_: nullable = ! terms[xs[0]].nullable; break;
+    }
+    long id = terms.size();
+    slot[i] = id;
+    hashes.push_back(h);
+    terms.emplace_back();
+    Term& t = terms.back();
+    t.kind = kind;
+    t.xs = move(xs);
+    t.nullable = nullable;
+    return id;
+  }
+
+  long atom(Fsa&& fsa) {
+    vector<long> key{fsa.start, long(fsa.finals.size())};
+    key.insert(key.end(), ALL(fsa.finals));
+    for (auto& es: fsa.adj) {
+      key.push_back(es.size());
+      for (auto& e: es)
+        key.insert(key.end(), {e.first.first, e.first.second, e.second});
+    }
+    auto it = atom_index.emplace(move(key), atoms.size());
+    if (it.second)
+      atoms.push_back(move(fsa));
+    long a = it.first->second;
+    return intern(Kind::atom, {a, atoms[a].start});
+  }
+
+  long concat(long x, long y) {
+    if (x == EMPTY || y == EMPTY)
+      return EMPTY;
+    if (x == EPSILON)
+      return y;
+    if (y == EPSILON)
+      return x;
+    if (terms[x].kind == Kind::concat) {
+      long x0 = terms[x].xs[0], x1 = terms[x].xs[1];
+      return concat(x0, concat(x1, y));
+    }
+    return intern(Kind::concat, {x, y});
+  }
+
+  long star(long x) {
+    if (x == EMPTY || x == EPSILON)
+      return EPSILON;
+    if (terms[x].kind == Kind::star)
+      return x;
+    return intern(Kind::star, {x});
+  }
+
+  long repeat(long x, long low, long high) {
+    if (high == 0 || x == EPSILON)
+      return EPSILON;
+    if (x == EMPTY)
+      return low == 0 ? EPSILON : EMPTY;
+    if (low == 0 && high == LONG_MAX)
+      return star(x);
+    if (low == 1 && high == 1)
+      return x;
+    return intern(Kind::repeat, {x, low, high});
+  }
+
+  long or_(const vector<long>& operands) {
+    vector<long> xs;
+    for (long x: operands)
+      if (x == FULL)
+        return FULL;
+      else if (terms[x].kind == Kind::or_)
+        xs.insert(xs.end(), ALL(terms[x].xs));
+      else if (x != EMPTY)
+        xs.push_back(x);
+    sort(ALL(xs));
+    xs.erase(unique(ALL(xs)), xs.end());
+    if (xs.size() <= 1)
+      return xs.empty() ? EMPTY : xs[0];
+    return intern(Kind::or_, move(xs));
+  }
+
+  long and_(const vector<long>& operands) {
+    vector<long> xs;
+    for (long x: operands)
+      if (x == EMPTY)
+        return EMPTY;
+      else if (terms[x].kind == Kind::and_)
+        xs.insert(xs.end(), ALL(terms[x].xs));
+      else if (x != FULL)
+        xs.push_back(x);
+    sort(ALL(xs));
+    xs.erase(unique(ALL(xs)), xs.end());
+    if (xs.size() <= 1)
+      return xs.empty() ? FULL : xs[0];
+    return intern(Kind::and_, move(xs));
+  }
+
+  // complement over [0, AB), as Fsa::operator~
+  long not_(long x) {
+    if (terms[x].kind == Kind::not_)
+      return terms[x].xs[0];
+    return intern(Kind::not_, {x});
+  }
+
+  const vector<long>& bounds(long t) {
+    if (terms[t].bounded)
+      return terms[t].bounds;
+    vector<long> bs;
+    Kind kind = terms[t].kind;
+    vector<long> xs = terms[t].xs;
+    auto add = [&](long x) {
+      auto& b = bounds(x);
+      bs.insert(bs.end(), ALL(b));
+    };
+    switch (kind) {
+    case Kind::empty:
+    case Kind::epsilon:
+      break;
+    case Kind::atom:
+      for (auto& e: atoms[xs[0]].adj[xs[1]]) {
+        bs.push_back(e.first.first);
+        bs.push_back(e.first.second);
+      }
+      break;
+    case Kind::concat:
+      add(xs[0]);
+      if (terms[xs[0]].nullable)
+        add(xs[1]);
+      break;
+    case Kind::star:
+    case Kind::repeat:
+      add(xs[0]);
+      break;
+    case Kind::or_:
+    case Kind::and_:
+      for (long x: xs)
+        add(x);
+      break;
+    case Kind::not_:
+      add(xs[0]);
+      bs.push_back(0);
+      bs.push_back(AB);
+      break;
+    }
+    sort(ALL(bs));
+    bs.erase(unique(ALL(bs)), bs.end());
+    Term& term = terms[t];
+    term.deriv.assign(bs.size()+1, -1);
+    term.bounds = move(bs);
+    term.bounded = true;
+    return term.bounds;
+  }
+
+  long derive(long t, long c) {
+    auto& bs = bounds(t);
+    long k = upper_bound(ALL(bs), c)-bs.begin();
+    if (terms[t].deriv[k] >= 0)
+      return terms[t].deriv[k];
+    long r = EMPTY;
+    Kind kind = terms[t].kind;
+    // `terms` may grow below, so operands are read by index
+    auto x = [&](long i) { return terms[t].xs[i]; };
+    if (0 < k && k < bs.size())
+      switch (kind) {
+      case Kind::empty:
+      case Kind::epsilon:
+        break;
+      case Kind::atom: {
+        long v = atoms[x(0)].transit(x(1), c);
+        if (v >= 0)
+          r = intern(Kind::atom, {x(0), v});
+        break;
+      }
+      case Kind::concat: {
+        long d0 = concat(derive(x(0), c), x(1));
+        r = terms[x(0)].nullable ? or_({d0, derive(x(1), c)}) : d0;
+        break;
+      }
+      case Kind::star:
+        r = concat(derive(x(0), c), t);
+        break;
+      case Kind::repeat: {
+        long d0 = derive(x(0), c);
+        r = concat(d0, repeat(x(0), max(x(1)-1, 0L), x(2) == LONG_MAX ? LONG_MAX : x(2)-1));
+        break;
+      }
+      case Kind::or_:
+      case Kind::and_: {
+        vector<long> ds;
+        REP(i, terms[t].xs.size())
+          ds.push_back(derive(x(i), c));
+        r = kind == Kind::or_ ? or_(ds) : and_(ds);
+        break;
+      }
+      case Kind::not_:
+        r = not_(derive(x(0), c));
+        break;
+      }
+    terms[t].deriv[k] = r;
+    return r;
+  }
+};
+
+struct TermBuilder : Visitor<Expr> {
+  Derivatives& d;
+  stack<long> st;
+  long utf8 = -1; // strings of valid UTF-8, complements are intersected with it
+
+  TermBuilder(Derivatives& d) : d(d) {}
+  long pop() {
+    long x = st.top();
+    st.pop();
+    return x;
+  }
+  void visit(Expr& expr) override {
+    expr.accept(*this);
+  }
+  void visit(BracketExpr& expr) override {
+    st.push(d.atom(move(FsaAnno::bracket(expr).fsa)));
+  }
+  void visit(CallExpr& expr) override {
+    assert(0);
+  }
+  void visit(CollapseExpr& expr) override {
+    assert(0);
+  }
+  void visit(ComplementExpr& expr) override {
+    visit(*expr.inner);
+    long x = d.not_(pop());
+    if (opt_utf8) {
+      if (utf8 < 0) {
+        FsaAnno u = FsaAnno::dot(NULL);
+        u.star(NULL);
+        u.determinize(NULL, NULL);
+        u.minimize(NULL);
+        utf8 = d.atom(move(u.fsa));
+      }
+      x = d.and_({x, utf8});
+    }
+    st.push(x);
+  }
+  void visit(ConcatExpr& expr) override {
+    visit(*expr.lhs);
+    visit(*expr.rhs);
+    long y = pop(), x = pop();
+    st.push(d.concat(x, y));
+  }
+  void visit(DifferenceExpr& expr) override {
+    visit(*expr.lhs);
+    visit(*expr.rhs);
+    long y = pop(), x = pop();
+    st.push(d.and_({x, d.not_(y)}));
+  }
+  void visit(DotExpr& expr) override {
+    st.push(d.atom(move(FsaAnno::dot(&expr).fsa)));
+  }
+  void visit(EmbedExpr& expr) override {
+    st.push(d.atom(move(FsaAnno::embed(expr).fsa)));
+  }
+  void visit(EpsilonExpr& expr) override {
+    st.push(Derivatives::EPSILON);
+  }
+  void visit(IntersectExpr& expr) override {
+    visit(*expr.lhs);
+    visit(*expr.rhs);
+    long y = pop(), x = pop();
+    st.push(d.and_({x, y}));
+  }
+  void visit(LiteralExpr& expr) override {
+    st.push(d.atom(move(FsaAnno::literal(expr).fsa)));
+  }
+  void visit(PlusExpr& expr) override {
+    visit(*expr.inner);
+    long x = pop();
+    st.push(d.concat(x, d.star(x)));
+  }
+  void visit(QuestionExpr& expr) override {
+    visit(*expr.inner);
+    st.push(d.or_({pop(), Derivatives::EPSILON}));
+  }
+  void visit(RepeatExpr& expr) override {
+    visit(*expr.inner);
+    st.push(d.repeat(pop(), expr.low, expr.high));
+  }
+  void visit(StarExpr& expr) override {
+    visit(*expr.inner);
+    st.push(d.star(pop()));
+  }
+  void visit(UnionExpr& expr) override {
+    visit(*expr.lhs);
+    visit(*expr.rhs);
+    long y = pop(), x = pop();
+    st.push(d.or_({x, y}));
+  }
+};
+
+struct Applicable : Visitor<Expr> {
+  bool ok = true;
+
+  void visit(Expr& expr) override {
+    if (! expr.no_action())
+      ok = false;
+    if (ok)
+      expr.accept(*this);
+  }
+  void visit(BracketExpr&) override {}
+  void visit(CallExpr&) override { ok = false; }
+  void visit(CollapseExpr&) override { ok = false; }
+  void visit(ComplementExpr& expr) override { visit(*expr.inner); }
+  void visit(ConcatExpr& expr) override {
+    visit(*expr.lhs);
+    visit(*expr.rhs);
+  }
+  void visit(DifferenceExpr& expr) override {
+    visit(*expr.lhs);
+    visit(*expr.rhs);
+  }
+  void visit(DotExpr&) override {}
+  void visit(EmbedExpr& expr) override {
+    if (expr.define_stmt) {
+      auto& assoc = compiled.at(expr.define_stmt).assoc;
+      if (any_of(ALL(assoc), [](AssocId as) { return as != 0; }))
+        ok = false;
+    }
+  }
+  void visit(EpsilonExpr&) override {}
+  void visit(IntersectExpr& expr) override {
+    visit(*expr.lhs);
+    visit(*expr.rhs);
+  }
+  void visit(LiteralExpr&) override {}
+  void visit(PlusExpr& expr) override { visit(*expr.inner); }
+  void visit(QuestionExpr& expr) override { visit(*expr.inner); }
+  void visit(RepeatExpr& expr) override { visit(*expr.inner); }
+  void visit(StarExpr& expr) override { visit(*expr.inner); }
+  void visit(UnionExpr& expr) override {
+    visit(*expr.lhs);
+    visit(*expr.rhs);
+  }
+};
+}
+
+bool derivatives_applicable(DefineStmt* stmt)
+{
+  if (stmt->intact || opt_mode == Mode::interactive)
+    return false;
+  Applicable app;
+  app.visit(*stmt->rhs);
+  return app.ok;
+}
+
+Fsa derivatives_dfa(Expr& expr)
+{
+  Derivatives d;
+  TermBuilder builder(d);
+  builder.visit(expr);
+  Fsa r;
+  r.start = 0;
+  vector<long> q{builder.pop()};
+  vector<long> term2state;
+  auto state = [&](long t) -> long& {
+    if (t >= term2state.size())
+      term2state.resize(d.terms.size(), -1);
+    return term2state[t];
+  };
+  state(q[0]) = 0;
+  REP(i, q.size()) {
+    long t = q[i];
+    if (d.terms[t].nullable)
+      r.finals.push_back(i);
+    r.adj.emplace_back();
+    vector<long> bs = d.bounds(t);
+    FOR(k, 1, bs.size()) {
+      long v = d.derive(t, bs[k-1]);
+      if (v == Derivatives::EMPTY)
+        continue;
+      long& j = state(v);
+      if (j < 0) {
+        j = q.size();
+        q.push_back(v);
+        check_limits("derivatives", q.size(), q.size()-i-1);
+      }
+      if (r.adj[i].size() && r.adj[i].back().first.second == bs[k-1] && r.adj[i].back().second == j)
+        r.adj[i].back().first.second = bs[k];
+      else
+        r.adj[i].emplace_back(make_pair(bs[k-1], bs[k]), j);
+    }
+  }
+  if (opt_keep_inaccessible || opt_substring_grammar)
+    return r;
+
+  // Terms such as x & ~x are empty without being EMPTY. Drop them as the products do, otherwise minimization
+  // keeps apart states that differ only in edges to them
+  vector<bool> live = r.live_states();
+  vector<long> id(r.n(), -1);
+  long m = 0;
+  REP(i, r.n())
+    if (live[i] || i == r.start)
+      id[i] = m++;
+  Fsa t;
+  t.start = id[r.start];
+  t.adj.resize(m);
+  REP(i, r.n())
+    if (id[i] >= 0)
+      for (auto& e: r.adj[i])
+        if (id[e.second] >= 0)
+          t.adj[id[i]].emplace_back(e.first, id[e.second]);
+  for (long f: r.finals)
+    t.finals.push_back(id[f]);
+  return t;
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include "fsa.hh"
+#include "syntax.hh"
+
+// --derivatives: the automaton of a DefineStmt is built directly as a DFA whose states are the Brzozowski
+// derivatives of its Expr, instead of a Thompson NFA which is then determinized.
+
+// Whether `stmt` can take this path. The states of the result have no assoc, so actions, CallExpr, CollapseExpr,
+// 'intact', interactive mode and EmbedExpr of DefineStmt with assoc need the Thompson construction.
+bool derivatives_applicable(DefineStmt* stmt);
+// * -> DFA, not minimized
+Fsa derivatives_dfa(Expr& expr);
@@ -4,29 +4,40 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <deque>
 #include <limits.h>
+#include <memory>
+#include <mutex>
 #include <queue>
-#include <set>
-#include <stack>
-#include <tuple>
-#include <unordered_map>
-#include <unordered_set>
+#include <sys/resource.h>
+#include <sysexits.h>
+#include <thread>
+#include <unistd.h>
 #include <utility>
 #include <vector>
 using namespace std;
 
-namespace std
+void (*fsa_limit_exceeded)(const char* construction, long states, long frontier);
+thread_local const void* fsa_limit_context;
+
+// peak RSS is sampled every 1024 states
+void check_limits(const char* construction, long states, long frontier)
 {
-  template<typename T>
-  struct hash<vector<T>> {
-    size_t operator()(const vector<T>& v) const {
-      hash<T> h;
-      size_t r = 0;
-      for (auto x: v)
-        r = r*17+h(x);
-      return r;
-    }
-  };
+  bool exceeded = opt_max_states && states > opt_max_states;
+  if (! exceeded && opt_max_memory && states % 1024 == 0) {
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    exceeded = ru.ru_maxrss/1024 > opt_max_memory;
+  }
+  if (exceeded) {
+    if (fsa_limit_exceeded)
+      fsa_limit_exceeded(construction, states, frontier);
+    // other threads may still be running
+    err_msg("%s: %ld states, %ld unexplored", construction, states, frontier);
+    fflush(NULL);
+    _exit(EX_DATAERR);
+  }
 }
 
 void Fsa::check() const
@@ -38,6 +49,32 @@ void Fsa::check() const
              adj[i][j-1].first.second <= adj[i][j].first.first);
 }
 
+void Fsa::add_epsilon(long u, long v)
+{
+  if (eps.size() <= u)
+    eps.resize(n());
+  eps[u].push_back(v);
+}
+
+long Fsa::append(Fsa& rhs)
+{
+  long ln = n();
+  for (auto& es: rhs.adj) {
+    for (auto& e: es)
+      e.second += ln;
+    adj.emplace_back(move(es));
+  }
+  if (rhs.eps.size()) {
+    eps.resize(ln);
+    for (auto& vs: rhs.eps) {
+      for (long& v: vs)
+        v += ln;
+      eps.emplace_back(move(vs));
+    }
+  }
+  return ln;
+}
+
 bool Fsa::has(long u, long c) const
 {
   auto it = upper_bound(ALL(adj[u]), make_pair(make_pair(c, LONG_MAX), LONG_MAX));
@@ -47,7 +84,7 @@ bool Fsa::has(long u, long c) const
 bool Fsa::has_call(long u) const
 {
   auto it = upper_bound(ALL(adj[u]), make_pair(make_pair(call_label_base, LONG_MAX), LONG_MAX));
-  return (it != adj[u].end() && it->first.first < call_label) || (it != adj[u].begin() && call_label_base < (--it)->first.second);
+  return (it != adj[u].end() && it->first.first < collapse_label_base) || (it != adj[u].begin() && call_label_base < (--it)->first.second);
 }
 
 bool Fsa::has_call_or_collapse(long u) const
@@ -67,26 +104,39 @@ bool Fsa::is_final(long x) const
   return binary_search(ALL(finals), x);
 }
 
-void Fsa::epsilon_closure(vector<long>& src) const
-{
-  static vector<bool> vis;
-  if (n() > vis.size())
-    vis.resize(n());
-  for (long i: src)
-    vis[i] = true;
-  REP(i, src.size()) {
-    long u = src[i];
-    for (auto& e: adj[u]) {
-      if (-1 < e.first.first) break;
-      if (! vis[e.second]) {
-        vis[e.second] = true;
-        src.push_back(e.second);
-      }
+vector<bool> Fsa::live_states() const
+{
+  vector<long> rbeg(n()+1, 0), rsrc, q = finals;
+  REP(i, n()) {
+    for (auto& e: adj[i])
+      rbeg[e.second+1]++;
+    if (i < eps.size())
+      for (long v: eps[i])
+        rbeg[v+1]++;
+  }
+  REP(i, n())
+    rbeg[i+1] += rbeg[i];
+  rsrc.resize(rbeg[n()]);
+  {
+    vector<long> pos(rbeg.begin(), rbeg.end()-1);
+    REP(i, n()) {
+      for (auto& e: adj[i])
+        rsrc[pos[e.second]++] = i;
+      if (i < eps.size())
+        for (long v: eps[i])
+          rsrc[pos[v]++] = i;
     }
   }
-  for (long i: src)
-    vis[i] = false;
-  sort(ALL(src));
+  vector<bool> live(n(), false);
+  for (long f: finals)
+    live[f] = true;
+  REP(i, q.size())
+    FOR(j, rbeg[q[i]], rbeg[q[i]+1])
+      if (! live[rsrc[j]]) {
+        live[rsrc[j]] = true;
+        q.push_back(rsrc[j]);
+      }
+  return live;
 }
 
 Fsa Fsa::operator~() const
@@ -119,151 +169,633 @@ Fsa Fsa::operator~() const
   return r;
 }
 
-void Fsa::accessible(const vector<long>* starts, function<void(long)> relate)
+void Fsa::compress_labels(vector<long>& scale)
 {
-  vector<long> q{start}, id(n(), 0);
-  id[start] = 1;
-  if (starts)
-    for (long u: *starts)
-      if (! id[u]) {
-        id[u] = 1;
-        q.push_back(u);
+  scale.assign({0, AB});
+  REP(i, n())
+    for (auto& e: adj[i])
+      if (0 <= e.first.first && e.first.second <= AB) {
+        scale.push_back(e.first.first);
+        scale.push_back(e.first.second);
       }
-  REP(i, q.size()) {
-    long u = q[i];
-    for (auto& e: adj[u]) {
-      //if (e.first.first >= AB) break;
-      if (! id[e.second]) {
-        id[e.second] = 1;
-        q.push_back(e.second);
+  sort(ALL(scale));
+  scale.erase(unique(ALL(scale)), scale.end());
+  REP(i, n())
+    for (auto& e: adj[i])
+      if (0 <= e.first.first && e.first.second <= AB) {
+        e.first.first = lower_bound(ALL(scale), e.first.first)-scale.begin();
+        e.first.second = lower_bound(ALL(scale), e.first.second)-scale.begin();
+      }
+}
+
+// When there are AB classes, determinization may have coalesced the last class with the labels from AB on:
+// scale[nclass] == AB, so the raw end is kept
+void Fsa::decompress_labels(const vector<long>& scale)
+{
+  long nclass = scale.size()-1;
+  REP(i, n())
+    for (auto& e: adj[i])
+      if (0 <= e.first.first && e.first.first < nclass) {
+        e.first.first = scale[e.first.first];
+        if (e.first.second <= nclass)
+          e.first.second = scale[e.first.second];
       }
+}
+
+static inline u64 mix64(u64 x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccduLL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53uLL;
+  x ^= x >> 33;
+  return x;
+}
+
+// Calls `f` with a value of the narrowest type holding the state numbers [0, n), which the passes below
+// use for their per-state and per-subset storage
+template<class F>
+static auto with_state_type(long n, F f)
+{
+  if (n < 1L << 16)
+    return f(uint16_t());
+  if (n < 1L << 32)
+    return f(uint32_t());
+  return f(long());
+}
+
+static u64 subset_hash(const vector<long>& xs)
+{
+  u64 h = xs.size();
+  for (long x: xs)
+    h = mix64(h ^ u64(x)) + 0x9e3779b97f4a7c15uLL;
+  return h;
+}
+
+// Each state set is stored once in `arena`; an open-addressing table maps sets to IDs
+template<class S>
+struct SubsetTable {
+  vector<S> arena;
+  vector<long> offset{0}, slot;
+  vector<u64> hashes;
+  long mask = -1;
+
+  long size() const { return hashes.size(); }
+  void get(long id, vector<long>& xs) const {
+    xs.assign(arena.begin()+offset[id], arena.begin()+offset[id+1]);
+  }
+  // returns (id, inserted)
+  pair<long, bool> insert(const vector<long>& xs, u64 h) {
+    if (2*(size()+1) > mask+1)
+      grow();
+    for (long i = h & mask; ; i = (i+1) & mask) {
+      long id = slot[i];
+      if (id < 0) {
+        slot[i] = id = size();
+        hashes.push_back(h);
+        arena.insert(arena.end(), ALL(xs));
+        offset.push_back(arena.size());
+        return {id, true};
+      }
+      if (hashes[id] == h && offset[id+1]-offset[id] == xs.size() && equal(ALL(xs), arena.begin()+offset[id]))
+        return {id, false};
     }
   }
+  void grow() {
+    mask = mask < 0 ? 63 : 2*mask+1;
+    slot.assign(mask+1, -1);
+    REP(id, size())
+      for (long i = hashes[id] & mask; ; i = (i+1) & mask)
+        if (slot[i] < 0) {
+          slot[i] = id;
+          break;
+        }
+  }
+};
 
-  long j = 0;
-  REP(i, n())
-    id[i] = id[i] ? j++ : -1;
+// Epsilon closures of the states entered by non-epsilon edges and of the starts.
+// Epsilon-SCCs are condensed with Tarjan's algorithm and each SCC gets one sorted span of `pool`.
+// Read-only after construction, so it can be shared by threads.
+template<class S>
+struct EpsilonClosure {
+  vector<long> scc;
+  vector<S> pool;
+  vector<pair<long, long>> span; // per SCC, {-1,-1} if not needed
 
-  auto it = finals.begin(), it2 = it;
-  REP(i, n())
-    if (id[i] >= 0) {
-      relate(i);
-      if (start == i)
-        start = id[i];
-      while (it != finals.end() && *it < i)
-        ++it;
-      if (it != finals.end() && *it == i)
-        *it2++ = id[i];
-      long k = 0;
-      for (auto& e: adj[i])
-        if (id[e.second] >= 0)
-          adj[i][k++] = {e.first, id[e.second]}; // unordered unless deterministic
-      adj[i].resize(k);
-      if (id[i] != i)
-        adj[id[i]] = move(adj[i]);
+  EpsilonClosure(const Fsa& fsa, const vector<long>* starts) : scc(fsa.n(), -1) {
+    long n = fsa.n(), nscc = 0, tick = 0;
+    vector<long> low(n), pre(n, -1), st, members, mbeg;
+    vector<pair<long, long>> path;
+    auto eps_size = [&](long u) { return u < fsa.eps.size() ? long(fsa.eps[u].size()) : 0L; };
+    // iterative Tarjan over epsilon edges, SCCs are numbered in reverse topological order
+    REP(i, n) {
+      if (pre[i] >= 0) continue;
+      path.emplace_back(i, 0);
+      pre[i] = low[i] = tick++;
+      st.push_back(i);
+      while (path.size()) {
+        long u = path.back().first;
+        long& j = path.back().second;
+        if (j < eps_size(u)) {
+          long v = fsa.eps[u][j++];
+          if (pre[v] < 0) {
+            pre[v] = low[v] = tick++;
+            st.push_back(v);
+            path.emplace_back(v, 0);
+          } else if (scc[v] < 0)
+            low[u] = min(low[u], pre[v]);
+          continue;
+        }
+        path.pop_back();
+        if (path.size())
+          low[path.back().first] = min(low[path.back().first], low[u]);
+        if (low[u] == pre[u]) {
+          mbeg.push_back(members.size());
+          long v;
+          do {
+            v = st.back();
+            st.pop_back();
+            scc[v] = nscc;
+            members.push_back(v);
+          } while (v != u);
+          nscc++;
+        }
+      }
+    }
+    mbeg.push_back(members.size());
+
+    vector<bool> need(nscc, false);
+    need[scc[fsa.start]] = true;
+    if (starts)
+      for (long u: *starts)
+        need[scc[u]] = true;
+    REP(i, n)
+      for (auto& e: fsa.adj[i])
+        need[scc[e.second]] = true;
+
+    // walk the condensation from each needed SCC
+    vector<long> mark(nscc, -1), q;
+    span.assign(nscc, make_pair(-1L, -1L));
+    REP(c, nscc) {
+      if (! need[c]) continue;
+      long b = pool.size();
+      q.assign(1, c);
+      mark[c] = c;
+      REP(k, q.size()) {
+        long d = q[k];
+        FOR(m, mbeg[d], mbeg[d+1]) {
+          long u = members[m];
+          pool.push_back(u);
+          REP(j, eps_size(u)) {
+            long e = scc[fsa.eps[u][j]];
+            if (mark[e] != c) {
+              mark[e] = c;
+              q.push_back(e);
+            }
+          }
+        }
+      }
+      sort(pool.begin()+b, pool.end());
+      span[c] = {b, pool.size()};
+    }
+  }
+
+  // `xs` is sorted and unique
+  void close(vector<long>& xs) const {
+    if (xs.size() == 1) {
+      auto& s = span[scc[xs[0]]];
+      xs.assign(pool.begin()+s.first, pool.begin()+s.second);
+      return;
+    }
+    long n = xs.size();
+    REP(i, n) {
+      auto& s = span[scc[xs[i]]];
+      if (s.second-s.first > 1)
+        xs.insert(xs.end(), pool.begin()+s.first, pool.begin()+s.second);
+    }
+    if (xs.size() > n) {
+      sort(ALL(xs));
+      xs.erase(unique(ALL(xs)), xs.end());
+    }
+  }
+};
+
+// Successors of a state set: a k-way merge of the sorted edge lists, with a heap of edge starts and a heap of edge ends
+template<class S>
+struct SubsetSweep {
+  typedef pair<long, long> Event;
+  const Fsa& fsa;
+  const EpsilonClosure<S>& closure;
+  vector<long> live, cnt, vs;
+  priority_queue<Event, vector<Event>, greater<Event>> starts_q, ends_q;
+  vector<pair<vector<Edge>::const_iterator, vector<Edge>::const_iterator>> its;
+
+  SubsetSweep(const Fsa& fsa, const EpsilonClosure<S>& closure) : fsa(fsa), closure(closure), cnt(fsa.n(), 0) {}
+
+  // `intern` maps the epsilon closure of live targets to an ID. Returns whether `x` contains a final state
+  template<typename F>
+  bool run(const vector<long>& x, vector<Edge>& out, F intern) {
+    bool final = false;
+    its.clear();
+    for (long u: x) {
+      if (fsa.is_final(u))
+        final = true;
+      auto it = fsa.adj[u].begin();
+      if (it != fsa.adj[u].end()) {
+        starts_q.emplace(it->first.first, its.size());
+        its.emplace_back(it, fsa.adj[u].end());
+      }
+    }
+    long last = 0;
+    while (starts_q.size() || ends_q.size()) {
+      long pos = starts_q.empty() ? ends_q.top().first : ends_q.empty() ? starts_q.top().first : min(starts_q.top().first, ends_q.top().first);
+      if (last < pos) {
+        if (live.size()) {
+          vs = live;
+          closure.close(vs);
+          long v = intern(vs);
+          if (out.size() && out.back().first.second == last && out.back().second == v) // coalesce two edges
+            out.back().first.second = pos;
+          else
+            out.emplace_back(make_pair(last, pos), v);
+        }
+        last = pos;
+      }
+      for (; ends_q.size() && ends_q.top().first == pos; ends_q.pop()) {
+        long v = ends_q.top().second;
+        if (! --cnt[v])
+          live.erase(lower_bound(ALL(live), v));
+      }
+      while (starts_q.size() && starts_q.top().first == pos) {
+        long i = starts_q.top().second;
+        starts_q.pop();
+        auto& it = its[i].first;
+        long v = it->second;
+        if (! cnt[v]++)
+          live.insert(upper_bound(ALL(live), v), v);
+        ends_q.emplace(it->first.second, v);
+        if (++it != its[i].second)
+          starts_q.emplace(it->first.first, i);
+      }
+    }
+    return final;
+  }
+};
+
+// Subsets are interned in sharded tables and explored by `jobs` threads with work stealing.
+// States are then renumbered by replaying the serial discovery order, so the result equals the serial one.
+template<class S>
+static Fsa parallel_determinize(const Fsa& fsa, const vector<long>* starts, function<void(long, const vector<long>&)> relate, long jobs)
+{
+  const long SHARD_BITS = 6, SHARDS = 1L << SHARD_BITS;
+  struct Shard {
+    mutex mu;
+    SubsetTable<S> table;
+  };
+  unique_ptr<Shard[]> shards(new Shard[SHARDS]);
+  atomic<long> n_states(0), pending(0);
+  auto intern = [&](const vector<long>& xs) {
+    u64 h = subset_hash(xs);
+    long s = h >> (64-SHARD_BITS);
+    pair<long, bool> t;
+    {
+      lock_guard<mutex> lock(shards[s].mu);
+      t = shards[s].table.insert(xs, h);
+    }
+    if (t.second)
+      check_limits("determinization", ++n_states, pending);
+    return make_pair(t.first << SHARD_BITS | s, t.second);
+  };
+
+  struct Result {
+    long id;
+    bool final;
+    vector<Edge> edges;
+  };
+  struct Worker {
+    mutex mu;
+    deque<pair<long, vector<long>>> tasks;
+    vector<Result> results;
+  };
+  unique_ptr<Worker[]> workers(new Worker[jobs]);
+
+  EpsilonClosure<S> closure(fsa, starts);
+  vector<long> roots, vs{fsa.start};
+  closure.close(vs);
+  roots.push_back(intern(vs).first);
+  workers[0].tasks.emplace_back(roots[0], vs);
+  if (starts)
+    for (long u: *starts) {
+      vs.assign(1, u);
+      closure.close(vs);
+      auto t = intern(vs);
+      roots.push_back(t.first);
+      if (t.second)
+        workers[0].tasks.emplace_back(t.first, vs);
     }
-  finals.erase(it2, finals.end());
-  adj.resize(j);
+  pending = workers[0].tasks.size();
+
+  const void* context = fsa_limit_context;
+  auto work = [&](long self) {
+    fsa_limit_context = context;
+    SubsetSweep<S> sweep(fsa, closure);
+    Worker& w = workers[self];
+    pair<long, vector<long>> task;
+    for(;;) {
+      bool got = false;
+      {
+        lock_guard<mutex> lock(w.mu);
+        if (w.tasks.size()) {
+          task = move(w.tasks.back());
+          w.tasks.pop_back();
+          got = true;
+        }
+      }
+      for (long i = 1; ! got && i < jobs; i++) {
+        Worker& victim = workers[(self+i) % jobs];
+        lock_guard<mutex> lock(victim.mu);
+        if (victim.tasks.size()) {
+          task = move(victim.tasks.front());
+          victim.tasks.pop_front();
+          got = true;
+        }
+      }
+      if (! got) {
+        if (! pending)
+          break;
+        this_thread::yield();
+        continue;
+      }
+      Result res;
+      res.id = task.first;
+      res.final = sweep.run(task.second, res.edges, [&](const vector<long>& xs) {
+        auto t = intern(xs);
+        if (t.second) {
+          pending++;
+          lock_guard<mutex> lock(w.mu);
+          w.tasks.emplace_back(t.first, xs);
+        }
+        return t.first;
+      });
+      w.results.push_back(move(res));
+      pending--;
+    }
+  };
+  vector<thread> threads;
+  REP(i, jobs)
+    threads.emplace_back(work, i);
+  for (auto& t: threads)
+    t.join();
+
+  // replay the serial discovery order
+  vector<vector<Result*>> res(SHARDS);
+  vector<vector<long>> id(SHARDS);
+  REP(s, SHARDS) {
+    res[s].resize(shards[s].table.size());
+    id[s].assign(shards[s].table.size(), -1);
+  }
+  REP(i, jobs)
+    for (auto& x: workers[i].results)
+      res[x.id & SHARDS-1][x.id >> SHARD_BITS] = &x;
+  Fsa r;
+  long allo = 0;
+  vector<long> st;
+  auto discover = [&](long g) {
+    long& x = id[g & SHARDS-1][g >> SHARD_BITS];
+    if (x < 0) {
+      x = allo++;
+      st.push_back(g);
+    }
+    return x;
+  };
+  r.start = discover(roots[0]);
+  FOR(i, 1, roots.size())
+    discover(roots[i]);
+  r.adj.resize(allo);
+  while (st.size()) {
+    long g = st.back(), s = g & SHARDS-1, j = g >> SHARD_BITS;
+    st.pop_back();
+    Result* x = res[s][j];
+    long u = id[s][j];
+    for (auto& e: x->edges)
+      e.second = discover(e.second);
+    if (allo > r.adj.size())
+      r.adj.resize(allo);
+    r.adj[u] = move(x->edges);
+    if (x->final)
+      r.finals.push_back(u);
+    shards[s].table.get(j, vs);
+    relate(u, vs);
+  }
+  sort(ALL(r.finals));
+  return r;
 }
 
-void Fsa::co_accessible(const vector<bool>*final, function<void(long)> relate)
+template<class S>
+static Fsa serial_determinize(const Fsa& fsa, const vector<long>* starts, function<void(long, const vector<long>&)> relate)
 {
-  vector<vector<long>> radj(n());
-  REP(i, n())
-    for (auto& e: adj[i]) {
-      //if (e.first.first >= AB) break;
-      radj[e.second].push_back(i);
+  Fsa r;
+  r.start = 0;
+  SubsetTable<S> m;
+  EpsilonClosure<S> closure(fsa, starts);
+  SubsetSweep<S> sweep(fsa, closure);
+  vector<long> vs{fsa.start}, x, st;
+  closure.close(vs);
+  m.insert(vs, subset_hash(vs));
+  st.push_back(0);
+  if (starts)
+    for (long u: *starts) {
+      vs.assign(1, u);
+      closure.close(vs);
+      auto t = m.insert(vs, subset_hash(vs));
+      if (t.second)
+        st.push_back(t.first);
     }
-  REP(i, n())
-    sort(ALL(radj[i]));
-  vector<long> q = finals, id(n(), 0);
-  for (long f: finals)
-    id[f] = 1;
-  if (final)
-    REP(i, n())
-      if ((*final)[i] && ! id[i]) {
-        id[i] = 1;
-        q.push_back(i);
+  while (st.size()) {
+    long id = st.back();
+    st.pop_back();
+    m.get(id, x);
+    if (id+1 > r.adj.size())
+      r.adj.resize(id+1);
+    relate(id, x);
+    bool final = sweep.run(x, r.adj[id], [&](const vector<long>& xs) {
+      auto t = m.insert(xs, subset_hash(xs));
+      if (t.second) {
+        st.push_back(t.first);
+        check_limits("determinization", m.size(), st.size());
       }
-  REP(i, q.size()) {
-    long u = q[i];
-    for (auto& v: radj[u])
-      if (! id[v]) {
-        id[v] = 1;
-        q.push_back(v);
+      return t.first;
+    });
+    if (final)
+      r.finals.push_back(id);
+  }
+  sort(ALL(r.finals));
+  return r;
+}
+
+Fsa Fsa::determinize(const vector<long>* starts, function<void(long, const vector<long>&)> relate, long jobs) const
+{
+  return with_state_type(n(), [&](auto s) {
+    typedef decltype(s) S;
+    return jobs > 1 ? parallel_determinize<S>(*this, starts, relate, jobs) : serial_determinize<S>(*this, starts, relate);
+  });
+}
+
+
+static bool is_dfa(const Fsa& fsa)
+{
+  for (auto& vs: fsa.eps)
+    if (vs.size())
+      return false;
+  for (auto& es: fsa.adj)
+    FOR(i, 1, es.size())
+      if (es[i-1].first.second > es[i].first.first)
+        return false;
+  return true;
+}
+
+// The subset automaton of a product operand, expanded only at the subsets the product visits.
+// A DFA operand is used as is: each state is its own subset.
+// A subset is live if it has a member that can reach a final state; all are live unless `trim`
+template<class S>
+struct LazySubsets {
+  const Fsa& fsa;
+  bool dfa;
+  vector<bool> live_state;
+  unique_ptr<EpsilonClosure<S>> closure;
+  unique_ptr<SubsetSweep<S>> sweep;
+  SubsetTable<S> table;
+  vector<vector<Edge>> edges;
+  vector<bool> expanded, live, final;
+  vector<long> xs;
+  vector<Edge> out;
+
+  LazySubsets(const Fsa& fsa, bool trim) : fsa(fsa), dfa(is_dfa(fsa)) {
+    live_state = trim ? fsa.live_states() : vector<bool>(fsa.n(), true);
+    if (! dfa) {
+      closure.reset(new EpsilonClosure<S>(fsa, NULL));
+      sweep.reset(new SubsetSweep<S>(fsa, *closure));
+      xs.assign(1, fsa.start);
+      closure->close(xs);
+      intern(xs);
+    }
+  }
+  long start() const { return dfa ? fsa.start : 0; }
+  bool is_live(long id) const { return dfa ? live_state[id] : live[id]; }
+  bool is_final(long id) const { return dfa ? fsa.is_final(id) : final[id]; }
+  void members(long id, vector<long>& ys) const {
+    if (dfa)
+      ys.assign(1, id);
+    else
+      table.get(id, ys);
+  }
+  long intern(const vector<long>& ys) {
+    auto t = table.insert(ys, subset_hash(ys));
+    if (t.second) {
+      bool l = false, f = false;
+      for (long y: ys) {
+        l = l || live_state[y];
+        f = f || fsa.is_final(y);
       }
+      edges.emplace_back();
+      expanded.push_back(false);
+      live.push_back(l);
+      final.push_back(f);
+    }
+    return t.first;
   }
-  if (! id[start]) {
-    start = 0;
-    finals.clear();
-    adj.assign(1, {});
-    return;
+  // valid until the next call
+  const vector<Edge>& adj(long id) {
+    if (dfa)
+      return fsa.adj[id];
+    if (! expanded[id]) {
+      table.get(id, xs);
+      out.clear();
+      sweep->run(xs, out, [&](const vector<long>& ys) { return intern(ys); });
+      edges[id] = out;
+      expanded[id] = true;
+    }
+    return edges[id];
   }
+};
 
-  long j = 0;
-  REP(i, n())
-    id[i] = id[i] ? j++ : -1;
+// Maps pairs of states to IDs in discovery order, `pairs` lists them by ID. Open addressing.
+// The states are subset IDs of LazySubsets, which are not bounded by the input sizes, so they stay long
+struct PairTable {
+  vector<pair<long, long>> pairs;
+  vector<long> slot;
+  long mask = -1;
 
-  auto it = finals.begin(), it2 = it;
-  REP(i, n())
-    if (id[i] >= 0) {
-      relate(i);
-      if (start == i)
-        start = id[i];
-      while (it != finals.end() && *it < i)
-        ++it;
-      if (it != finals.end() && *it == i)
-        *it2++ = id[i];
-      long k = 0;
-      for (auto& e: adj[i])
-        if (id[e.second] >= 0)
-          adj[i][k++] = {e.first, id[e.second]}; // unordered unless deterministic
-      adj[i].resize(k);
-      if (id[i] != i)
-        adj[id[i]] = move(adj[i]);
+  static u64 hash(long x, long y) { return mix64(u64(x) * 0x9e3779b97f4a7c15uLL ^ u64(y)); }
+  long size() const { return pairs.size(); }
+  // returns (id, inserted)
+  pair<long, bool> insert(long x, long y) {
+    if (2*(size()+1) > mask+1)
+      grow();
+    for (long i = hash(x, y) & mask; ; i = (i+1) & mask) {
+      long id = slot[i];
+      if (id < 0) {
+        slot[i] = id = size();
+        pairs.emplace_back(x, y);
+        return {id, true};
+      }
+      if (pairs[id].first == x && pairs[id].second == y)
+        return {id, false};
     }
-  finals.erase(it2, finals.end());
-  adj.resize(j);
-}
+  }
+  void grow() {
+    mask = mask < 0 ? 63 : 2*mask+1;
+    slot.assign(mask+1, -1);
+    REP(id, size())
+      for (long i = hash(pairs[id].first, pairs[id].second) & mask; ; i = (i+1) & mask)
+        if (slot[i] < 0) {
+          slot[i] = id;
+          break;
+        }
+  }
+};
 
-Fsa Fsa::difference(const Fsa& rhs, function<void(long)> relate) const
+// Dead subsets of `b` behave like the implicit dead state -1
+template<class L, class R>
+static Fsa product_difference(L& a, R& b, function<void(const vector<long>&)> relate)
 {
+  static const vector<Edge> none;
   Fsa r;
-  vector<pair<long, long>> q;
-  unordered_map<long, long> m;
-  q.emplace_back(start, rhs.start);
-  m[(rhs.n()+1) * start + rhs.start] = 0;
+  PairTable m;
+  vector<long> xs;
+  m.insert(a.start(), b.is_live(b.start()) ? b.start() : -1);
   r.start = 0;
-  REP(i, q.size()) {
-    long u0, u1, v0, v1;
-    tie(u0, u1) = q[i];
-    if (is_final(u0) && ! rhs.is_final(u1))
+  if (! a.is_live(a.start())) {
+    a.members(a.start(), xs);
+    relate(xs);
+    r.adj.emplace_back();
+    return r;
+  }
+  REP(i, m.size()) {
+    long u0 = m.pairs[i].first, u1 = m.pairs[i].second;
+    if (a.is_final(u0) && ! (u1 >= 0 && b.is_final(u1)))
       r.finals.push_back(i);
     r.adj.emplace_back();
-    relate(u0);
-    vector<Edge>::const_iterator it0 = adj[u0].begin(), it1, it1e;
-    if (u1 == rhs.n())
-      it1 = it1e = rhs.adj[0].end();
-    else {
-      it1 = rhs.adj[u1].begin();
-      it1e = rhs.adj[u1].end();
-    }
+    a.members(u0, xs);
+    relate(xs);
+    const vector<Edge>& es0 = a.adj(u0);
+    const vector<Edge>& es1 = u1 >= 0 ? b.adj(u1) : none;
+    auto it0 = es0.begin(), it1 = es1.begin();
     long last = LONG_MIN;
-    while (it0 != adj[u0].end()) {
+    while (it0 != es0.end()) {
       long from = max(last, it0->first.first), to = it0->first.second;
-      while (it1 != it1e && it1->first.second <= from)
+      while (it1 != es1.end() && it1->first.second <= from)
         ++it1;
-      if (it1 != it1e)
+      if (it1 != es1.end())
         to = min(to, from < it1->first.first ? it1->first.first : it1->first.second);
       last = to;
-      long v1 = it1 != it1e && it1->first.first <= from ? it1->second : rhs.n(),
-           t = (rhs.n()+1) * it0->second + v1;
-      auto mit = m.find(t);
-      if (mit == m.end()) {
-        mit = m.emplace(t, m.size()).first;
-        q.emplace_back(it0->second, v1);
+      if (a.is_live(it0->second)) {
+        long v1 = it1 != es1.end() && it1->first.first <= from && b.is_live(it1->second) ? it1->second : -1;
+        auto t = m.insert(it0->second, v1);
+        if (t.second)
+          check_limits("difference", m.size(), m.size()-i-1);
+        r.adj[i].emplace_back(make_pair(from, to), t.first);
       }
-      r.adj[i].emplace_back(make_pair(from, to), mit->second);
       if (to == it0->first.second)
         ++it0;
     }
@@ -271,35 +803,44 @@ Fsa Fsa::difference(const Fsa& rhs, function<void(long)> relate) const
   return r;
 }
 
-Fsa Fsa::intersect(const Fsa& rhs, function<void(long, long)> relate) const
+template<class L, class R>
+static Fsa product_intersect(L& a, R& b, function<void(const vector<long>&, const vector<long>&)> relate)
 {
   Fsa r;
-  vector<pair<long, long>> q;
-  long u0, u1, v0, v1;
-  unordered_map<long, long> m;
-  q.emplace_back(start, rhs.start);
-  m[rhs.n() * start + rhs.start] = 0;
+  PairTable m;
+  vector<long> xs, ys;
+  m.insert(a.start(), b.start());
   r.start = 0;
-  REP(i, q.size()) {
-    tie(u0, u1) = q[i];
-    if (is_final(u0) && rhs.is_final(u1))
+  if (! a.is_live(a.start()) || ! b.is_live(b.start())) {
+    a.members(a.start(), xs);
+    b.members(b.start(), ys);
+    relate(xs, ys);
+    r.adj.emplace_back();
+    return r;
+  }
+  REP(i, m.size()) {
+    long u0 = m.pairs[i].first, u1 = m.pairs[i].second;
+    if (a.is_final(u0) && b.is_final(u1))
       r.finals.push_back(i);
     r.adj.emplace_back();
-    relate(u0, u1);
-    auto it0 = adj[u0].begin(), it1 = rhs.adj[u1].begin();
-    while (it0 != adj[u0].end() && it1 != rhs.adj[u1].end()) {
+    a.members(u0, xs);
+    b.members(u1, ys);
+    relate(xs, ys);
+    const vector<Edge>& es0 = a.adj(u0);
+    const vector<Edge>& es1 = b.adj(u1);
+    auto it0 = es0.begin(), it1 = es1.begin();
+    while (it0 != es0.end() && it1 != es1.end()) {
       if (it0->first.second <= it1->first.first)
         ++it0;
       else if (it1->first.second <= it0->first.first)
         ++it1;
       else {
-        long t = rhs.n() * it0->second + it1->second;
-        auto mit = m.find(t);
-        if (mit == m.end()) {
-          mit = m.emplace(t, m.size()).first;
-          q.emplace_back(it0->second, it1->second);
+        if (a.is_live(it0->second) && b.is_live(it1->second)) {
+          auto t = m.insert(it0->second, it1->second);
+          if (t.second)
+            check_limits("intersection", m.size(), m.size()-i-1);
+          r.adj[i].emplace_back(make_pair(max(it0->first.first, it1->first.first), min(it0->first.second, it1->first.second)), t.first);
         }
-        r.adj[i].emplace_back(make_pair(max(it0->first.first, it1->first.first), min(it0->first.second, it1->first.second)), mit->second);
         if (it0->first.second < it1->first.second)
           ++it0;
         else if (it0->first.second > it1->first.second)
@@ -312,260 +853,379 @@ Fsa Fsa::intersect(const Fsa& rhs, function<void(long, long)> relate) const
   return r;
 }
 
-Fsa Fsa::determinize(const vector<long>* starts, function<void(long, const vector<long>&)> relate) const
+// Pairs whose left subset cannot reach a final state are not built if `trim`
+Fsa Fsa::difference(const Fsa& rhs, function<void(const vector<long>&)> relate, bool trim) const
+{
+  return with_state_type(n(), [&](auto s0) {
+    return with_state_type(rhs.n(), [&](auto s1) {
+      LazySubsets<decltype(s0)> a(*this, trim);
+      LazySubsets<decltype(s1)> b(rhs, true);
+      return product_difference(a, b, relate);
+    });
+  });
+}
+
+// Pairs with a side that cannot reach a final state are not built if `trim`
+Fsa Fsa::intersect(const Fsa& rhs, function<void(const vector<long>&, const vector<long>&)> relate, bool trim) const
+{
+  return with_state_type(n(), [&](auto s0) {
+    return with_state_type(rhs.n(), [&](auto s1) {
+      LazySubsets<decltype(s0)> a(*this, trim);
+      LazySubsets<decltype(s1)> b(rhs, trim);
+      return product_intersect(a, b, relate);
+    });
+  });
+}
+
+FrozenFsa::FrozenFsa(Fsa&& fsa) : start(fsa.start), finals(move(fsa.finals))
+{
+  long m = 0;
+  for (auto& es: fsa.adj)
+    m += es.size();
+  off.reserve(fsa.n()+1);
+  edges.reserve(m);
+  for (auto& es: fsa.adj) {
+    edges.insert(edges.end(), ALL(es));
+    off.push_back(edges.size());
+    vector<Edge>().swap(es);
+  }
+  fsa.adj.clear();
+  build_reverse();
+}
+
+void FrozenFsa::build_reverse()
+{
+  roff.assign(n()+1, 0);
+  for (auto& e: edges)
+    roff[e.second+1]++;
+  REP(i, n())
+    roff[i+1] += roff[i];
+  redges.resize(edges.size());
+  vector<long> pos(roff.begin(), roff.end()-1);
+  REP(j, edges.size())
+    redges[pos[edges[j].second]++] = j;
+}
+
+Fsa FrozenFsa::thaw() const
 {
   Fsa r;
-  r.start = 0;
-  unordered_map<vector<long>, long> m;
-  vector<vector<Edge>::const_iterator> its(n());
-  vector<long> vs{start};
-  vector<pair<long, long>> events;
-  stack<vector<long>> st;
-  epsilon_closure(vs);
-  m[vs] = 0;
-  st.push(move(vs));
-  if (starts)
-    for (long u: *starts) {
-      vs.assign(1, u);
-      epsilon_closure(vs);
-      if (! m.count(vs)) {
-        m.emplace(vs, m.size());
-        st.push(move(vs));
-      }
-    }
-  while (st.size()) {
-    vector<long> x = move(st.top());
-    st.pop();
-    long id = m[x];
-    if (id+1 > r.adj.size())
-      r.adj.resize(id+1);
-    relate(id, x);
-    bool final = false;
-    events.clear();
-    for (long u: x) {
-      if (is_final(u))
-        final = true;
-      for (auto& e: adj[u]) {
-        events.emplace_back(e.first.first, e.second);
-        events.emplace_back(e.first.second, ~ e.second);
-      }
-    }
-    if (final)
-      r.finals.push_back(id);
-    long last = 0;
-    multiset<long> live;
-    sort(ALL(events));
-    for (auto& ev: events) {
-      if (last < ev.first) {
-        if (live.size()) {
-          vs.assign(ALL(live));
-          vs.erase(unique(ALL(vs)), vs.end());
-          epsilon_closure(vs);
-          auto mit = m.find(vs);
-          if (mit == m.end()) {
-            mit = m.emplace(vs, m.size()).first;
-            st.push(vs);
-          }
-          if (r.adj[id].size() && r.adj[id].back().first.second == last && r.adj[id].back().second == mit->second) // coalesce two edges
-            r.adj[id].back().first.second = ev.first;
-          else
-            r.adj[id].emplace_back(make_pair(last, ev.first), mit->second);
-        }
-        last = ev.first;
-      }
-      if (ev.second >= 0)
-        live.insert(ev.second);
-      else
-        live.erase(live.find(~ ev.second));
+  r.start = start;
+  r.finals = finals;
+  r.adj.resize(n());
+  REP(i, n())
+    r.adj[i].assign(edges.begin()+off[i], edges.begin()+off[i+1]);
+  return r;
+}
+
+bool FrozenFsa::is_final(long x) const
+{
+  return binary_search(ALL(finals), x);
+}
+
+bool FrozenFsa::has_call(long u) const
+{
+  auto es = adj(u);
+  auto it = upper_bound(ALL(es), make_pair(make_pair(call_label_base, LONG_MAX), LONG_MAX));
+  return (it != es.end() && it->first.first < collapse_label_base) || (it != es.begin() && call_label_base < (--it)->first.second);
+}
+
+long FrozenFsa::transit(long u, long c) const
+{
+  auto es = adj(u);
+  auto it = upper_bound(ALL(es), make_pair(make_pair(c, LONG_MAX), LONG_MAX));
+  return it != es.begin() && c < (--it)->first.second ? it->second : -1;
+}
+
+FrozenFsa FrozenFsa::map_states(const vector<long>& id, function<void(long)> relate) const
+{
+  long nn = 0;
+  vector<long> inv(n());
+  REP(i, n())
+    if (id[i] >= 0) {
+      inv[id[i]] = i;
+      nn++;
     }
-  }
+  FrozenFsa r;
+  r.start = id[start];
+  for (long f: finals)
+    if (id[f] >= 0)
+      r.finals.push_back(id[f]);
   sort(ALL(r.finals));
+  r.off.reserve(nn+1);
+  REP(i, nn) {
+    long u = inv[i];
+    relate(u);
+    for (auto& e: adj(u))
+      if (id[e.second] >= 0)
+        r.edges.emplace_back(e.first, id[e.second]);
+    r.off.push_back(r.edges.size());
+  }
+  r.build_reverse();
   return r;
 }
 
-Fsa Fsa::distinguish(function<void(vector<long>&)> relate) const
+FrozenFsa FrozenFsa::truncate_labels(long bound) const
 {
-  vector<long> scale;
+  FrozenFsa r;
+  r.start = start;
+  r.finals = finals;
+  r.off.reserve(n()+1);
+  REP(i, n()) {
+    for (auto& e: adj(i))
+      if (e.first.first < bound)
+        r.edges.emplace_back(make_pair(e.first.first, min(e.first.second, bound)), e.second);
+    r.off.push_back(r.edges.size());
+  }
+  r.build_reverse();
+  return r;
+}
+
+FrozenFsa FrozenFsa::accessible(const vector<long>* starts, function<void(long)> relate) const
+{
+  return with_state_type(n(), [&](auto s) { return accessible_with<decltype(s)>(starts, relate); });
+}
+
+template<class S>
+FrozenFsa FrozenFsa::accessible_with(const vector<long>* starts, function<void(long)> relate) const
+{
+  vector<S> q{S(start)};
+  vector<long> id(n(), 0);
+  id[start] = 1;
+  if (starts)
+    for (long u: *starts)
+      if (! id[u]) {
+        id[u] = 1;
+        q.push_back(u);
+      }
+  REP(i, q.size())
+    for (auto& e: adj(q[i]))
+      if (! id[e.second]) {
+        id[e.second] = 1;
+        q.push_back(e.second);
+      }
+  long j = 0;
   REP(i, n())
-    for (auto& e: adj[i]) {
-      scale.push_back(e.first.first);
-      scale.push_back(e.first.second);
-    }
-  sort(ALL(scale));
-  scale.erase(unique(ALL(scale)), scale.end());
+    id[i] = id[i] ? j++ : -1;
+  return map_states(id, relate);
+}
 
-  vector<vector<pair<long, long>>> radj(n());
+FrozenFsa FrozenFsa::co_accessible(const vector<bool>* final, function<void(long)> relate) const
+{
+  return with_state_type(n(), [&](auto s) { return co_accessible_with<decltype(s)>(final, relate); });
+}
+
+template<class S>
+FrozenFsa FrozenFsa::co_accessible_with(const vector<bool>* final, function<void(long)> relate) const
+{
+  vector<S> q(ALL(finals)), tail(edges.size());
+  vector<long> id(n(), 0);
   REP(i, n())
-    for (auto& e: adj[i]) {
-      long from = lower_bound(ALL(scale), e.first.first) - scale.begin(),
-           to = lower_bound(ALL(scale), e.first.second) - scale.begin();
-      FOR(j, from, to)
-        radj[e.second].emplace_back(j, i);
+    FOR(j, off[i], off[i+1])
+      tail[j] = i;
+  for (long f: finals)
+    id[f] = 1;
+  if (final)
+    REP(i, n())
+      if ((*final)[i] && ! id[i]) {
+        id[i] = 1;
+        q.push_back(i);
+      }
+  REP(i, q.size()) {
+    long v = q[i];
+    FOR(j, roff[v], roff[v+1]) {
+      long u = tail[redges[j]];
+      if (! id[u]) {
+        id[u] = 1;
+        q.push_back(u);
+      }
     }
+  }
+  if (! id[start]) {
+    Fsa r;
+    r.start = 0;
+    r.adj.resize(1);
+    return FrozenFsa(move(r));
+  }
+  long j = 0;
   REP(i, n())
-    sort(ALL(radj[i]));
-  vector<long> L(n()), R(n()), B(n()), C(n(), 0), CC(n(), 0);
-  vector<bool> mark(n(), false);
+    id[i] = id[i] ? j++ : -1;
+  return map_states(id, relate);
+}
 
-  // distinguish finals & non-finals
-  long fx = -1, x = -1, fy = -1, y = -1, j = 0;
+Fsa FrozenFsa::distinguish(function<void(vector<long>&)> relate) const
+{
+  return with_state_type(n(), [&](auto s) { return distinguish_with<decltype(s)>(relate); });
+}
+
+template<class S>
+Fsa FrozenFsa::distinguish_with(function<void(vector<long>&)> relate) const
+{
+  vector<S> tail(edges.size());
   REP(i, n())
-    if (j < finals.size() && finals[j] == i) {
-      j++;
-      if (y < 0)
-        fy = i;
-      else
-        R[y] = i;
-      C[B[i] = fy]++;
-      L[i] = y;
-      y = i;
-    } else {
-      if (x < 0)
-        fx = i;
+    FOR(j, off[i], off[i+1])
+      tail[j] = i;
+
+  // blocks are contiguous ranges [first[b], last[b]) of `elems`
+  vector<S> elems(n()), loc(n()), blk(n()), first, last;
+  vector<bool> in_worklist;
+  vector<S> worklist;
+  {
+    long j = 0, k = 0;
+    REP(i, n())
+      if (j < finals.size() && finals[j] == i)
+        j++;
       else
-        R[x] = i;
-      C[B[i] = fx]++;
-      L[i] = x;
-      x = i;
+        elems[k++] = i;
+    for (long f: finals)
+      elems[k++] = f;
+    if (n() > finals.size()) {
+      first.push_back(0);
+      last.push_back(n()-finals.size());
     }
-  if (x >= 0)
-    L[fx] = x, R[x] = fx;
-  if (y >= 0)
-    L[fy] = y, R[y] = fy;
-
-  set<pair<long, long>> refines;
-  auto labels = [&](long fx) {
-    vector<long> lb;
-    for (long x = fx; ; ) {
-      for (auto& e: radj[x])
-        lb.push_back(e.first);
-      if ((x = R[x]) == fx) break;
+    if (finals.size()) {
+      first.push_back(n()-finals.size());
+      last.push_back(n());
     }
-    sort(ALL(lb));
-    lb.erase(unique(ALL(lb)), lb.end());
-    return lb;
+    REP(b, first.size())
+      FOR(i, first[b], last[b]) {
+        loc[elems[i]] = i;
+        blk[elems[i]] = b;
+      }
+    // partial transition functions: the implicit dead state makes every initial block a splitter
+    in_worklist.assign(first.size(), true);
+    REP(b, first.size())
+      worklist.push_back(b);
+  }
+
+  // labels leading into the splitter: sig[sig_beg[p], sig_end[p]) for predecessor p
+  vector<pair<S, Label>> pred;
+  vector<Label> sig;
+  vector<long> sig_beg(n()), sig_end(n());
+  vector<S> touched;
+  auto sig_less = [&](long x, long y) {
+    if (blk[x] != blk[y])
+      return blk[x] < blk[y];
+    return lexicographical_compare(sig.begin()+sig_beg[x], sig.begin()+sig_end[x], sig.begin()+sig_beg[y], sig.begin()+sig_end[y]);
+  };
+  auto sig_equal = [&](long x, long y) {
+    return sig_end[x]-sig_beg[x] == sig_end[y]-sig_beg[y] && equal(sig.begin()+sig_beg[x], sig.begin()+sig_end[x], sig.begin()+sig_beg[y]);
   };
 
-  if (fx >= 0)
-    for (long a: labels(fx))
-      refines.emplace(a, fx);
-  if (fy >= 0)
-    for (long a: labels(fy))
-      refines.emplace(a, fy);
-  while (refines.size()) {
-    long a;
-    tie(a, fx) = *refines.begin();
-    refines.erase(refines.begin());
-    // count
-    vector<long> bs;
-    for (x = fx; ; ) {
-      auto it = lower_bound(ALL(radj[x]), make_pair(a, 0L)),
-           ite = upper_bound(ALL(radj[x]), make_pair(a, n()));
-      for (; it != ite; ++it) {
-        y = it->second;
-        if (! CC[B[y]]++)
-          bs.push_back(B[y]);
-        mark[y] = true;
-      }
-      if ((x = R[x]) == fx) break;
+  while (worklist.size()) {
+    long s = worklist.back();
+    worklist.pop_back();
+    in_worklist[s] = false;
+
+    pred.clear();
+    FOR(i, first[s], last[s]) {
+      long v = elems[i];
+      FOR(j, roff[v], roff[v+1])
+        pred.emplace_back(tail[redges[j]], edges[redges[j]].first);
     }
-    // for each refinable set
-    for (long fy: bs) {
-      if (CC[fy] < C[fy]) {
-        long fu = -1, u = -1, cu = 0,
-             fv = -1, v = -1, cv = 0;
-        vector<long> lb = labels(fy);
-        for (long i = fy; ; ) {
-          if (mark[i]) {
-            mark[i] = false;
-            if (u < 0)
-              C[fu = i] = 0;
-            else
-              R[u] = i;
-            C[fu]++;
-            B[i] = fu;
-            L[i] = u;
-            u = i;
-          } else {
-            if (v < 0)
-              C[fv = i] = 0;
-            else
-              R[v] = i;
-            C[fv]++;
-            B[i] = fv;
-            L[i] = v;
-            v = i;
-          }
-          if ((i = R[i]) == fy) break;
-        }
-        L[fu] = u, R[u] = fu;
-        L[fv] = v, R[v] = fv;
-        //REP(a, AB+1)
-        for (long a: lb)
-          if (refines.count({a, fy}))
-            refines.emplace(a, fu != fy ? fu : fv);
-          else
-            refines.emplace(a, C[fu] < C[fv] ? fu : fv);
-      } else
-        for (long i = fy; ; ) {
-          mark[i] = false;
-          if ((i = R[i]) == fy) break;
-        }
-      CC[fy] = 0;
+    if (pred.empty()) continue;
+    sort(ALL(pred));
+    sig.clear();
+    touched.clear();
+    for (auto it = pred.begin(); it != pred.end(); ) {
+      long p = it->first;
+      touched.push_back(p);
+      sig_beg[p] = sig.size();
+      for (; it != pred.end() && it->first == p; ++it)
+        if (sig.size() > sig_beg[p] && sig.back().second == it->second.first)
+          sig.back().second = it->second.second;
+        else
+          sig.push_back(it->second);
+      sig_end[p] = sig.size();
     }
-    // clear marks
-    for (x = fx; ; ) {
-      auto it = lower_bound(ALL(radj[x]), make_pair(a, 0L)),
-           ite = upper_bound(ALL(radj[x]), make_pair(a, n()));
-      for (; it != ite; ++it) {
-        y = it->second;
-        CC[B[y]] = 0;
-        mark[y] = false;
+    sort(ALL(touched), sig_less);
+
+    for (auto it = touched.begin(); it != touched.end(); ) {
+      long b = blk[*it];
+      auto ite = it;
+      while (ite != touched.end() && blk[*ite] == b)
+        ++ite;
+      long t = ite-it, mid = last[b]-t;
+      if (t == last[b]-first[b] && sig_equal(*it, *(ite-1))) {
+        it = ite;
+        continue;
+      }
+      // move touched states to the end of the block, ordered by signature
+      for (auto jt = it; jt != ite; ++jt) {
+        long p = *jt, q = elems[--last[b]];
+        swap(elems[loc[p]], elems[last[b]]);
+        swap(loc[p], loc[q]);
+      }
+      last[b] += t;
+      for (auto jt = it; jt != ite; ++jt) {
+        elems[mid+(jt-it)] = *jt;
+        loc[*jt] = mid+(jt-it);
       }
-      if ((x = R[x]) == fx) break;
+      // split into pieces: untouched, then one per signature
+      vector<long> pieces;
+      long end = last[b];
+      if (first[b] < mid) {
+        last[b] = mid;
+        pieces.push_back(b);
+      }
+      for (auto jt = it; jt != ite; ) {
+        auto kt = jt;
+        while (++kt != ite && sig_equal(*jt, *kt));
+        long c = pieces.empty() ? b : first.size();
+        if (c != b) {
+          first.push_back(mid+(jt-it));
+          in_worklist.push_back(false);
+        } else
+          first[b] = mid;
+        last.resize(first.size());
+        last[c] = mid+(kt-it);
+        for (; jt != kt; ++jt)
+          blk[*jt] = c;
+        pieces.push_back(c);
+      }
+      assert(last[pieces.back()] == end);
+      // Hopcroft: if b is pending, all pieces are; otherwise the largest piece can be omitted
+      long largest = -1;
+      if (! in_worklist[b])
+        for (long c: pieces)
+          if (largest < 0 || last[c]-first[c] > last[largest]-first[largest])
+            largest = c;
+      for (long c: pieces)
+        if (c != largest && ! in_worklist[c]) {
+          in_worklist[c] = true;
+          worklist.push_back(c);
+        }
+      it = ite;
     }
   }
 
+  // number blocks by their smallest states
   Fsa r;
   long nn = 0;
-  vector<long> vs;
+  vector<long> id(first.size(), -1), vs;
   REP(i, n())
-    if (B[i] == i) {
-      vs.clear();
-      for (long j = i; ; ) {
-        B[j] = nn;
-        vs.push_back(j);
-        if ((j = R[j]) == i) break;
-      }
+    if (id[blk[i]] < 0) {
+      long b = blk[i];
+      id[b] = nn;
+      vs.assign(elems.begin()+first[b], elems.begin()+last[b]);
+      sort(ALL(vs));
       relate(vs);
       if (binary_search(ALL(finals), i))
         r.finals.push_back(nn);
       nn++;
     }
-  r.start = B[start];
+  r.start = id[blk[start]];
   r.adj.resize(nn);
+  vector<bool> done(nn, false);
   REP(i, n())
-    for (auto& e: adj[i])
-      r.adj[B[i]].emplace_back(e.first, B[e.second]);
-  REP(i, nn) {
-    // merge edges with the same destination
-    sort(ALL(r.adj[i]), [](const Edge& x, const Edge& y) {
-      return x.second != y.second ? x.second < y.second : x.first < y.first;
-    });
-    auto it2 = r.adj[i].begin();
-    for (auto it = r.adj[i].begin(); it != r.adj[i].end(); ) {
-      long v = it->second, from = it->first.first, to = it->first.second;
-      while (++it != r.adj[i].end() && it->second == v)
-        if (it->first.first <= to)
-          to = max(to, it->first.second);
-        else {
-          *it2++ = make_pair(make_pair(from, to), v);
-          tie(from, to) = it->first;
-        }
-      *it2++ = make_pair(make_pair(from, to), v);
+    if (! done[id[blk[i]]]) {
+      // equivalent states have the same transitions, take the smallest one
+      done[id[blk[i]]] = true;
+      auto& es = r.adj[id[blk[i]]];
+      for (auto& e: adj(i))
+        if (es.size() && es.back().first.second == e.first.first && es.back().second == id[blk[e.second]])
+          es.back().first.second = e.first.second;
+        else
+          es.emplace_back(e.first, id[blk[e.second]]);
     }
-    r.adj[i].erase(it2, r.adj[i].end());
-    sort(ALL(r.adj[i]));
-  }
   return r;
 }
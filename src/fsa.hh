@@ -9,32 +9,86 @@ using std::vector;
 typedef pair<long, long> Label;
 typedef pair<Label, long> Edge;
 
-const Label epsilon{-1L, 0L};
+// Called when a subset/product construction exceeds --max-states/--max-memory, with the number of states
+// and unexplored states. Set by the compiler to report what was being expanded; does not return.
+extern void (*fsa_limit_exceeded)(const char* construction, long states, long frontier);
+// What the calling thread is expanding, opaque here and read by fsa_limit_exceeded. Determinization workers
+// inherit it from the thread that started them.
+extern thread_local const void* fsa_limit_context;
+void check_limits(const char* construction, long states, long frontier);
 
 struct Fsa {
   long start;
   vector<long> finals; // sorted
-  vector<vector<Edge>> adj; // sorted
+  vector<vector<Edge>> adj; // sorted, without epsilon edges
+  vector<vector<long>> eps; // epsilon successors, shorter than `adj` if the remaining states have none
 
   void check() const;
   long n() const { return adj.size(); }
+  void add_epsilon(long u, long v);
+  // moves the states of `rhs` after ours, returns the offset of their numbers
+  long append(Fsa& rhs);
   bool is_final(long x) const;
+  // states that can reach a final state
+  vector<bool> live_states() const;
   bool has(long u, long c) const;
   bool has_call(long u) const;
   bool has_call_or_collapse(long u) const;
   long transit(long u, long c) const;
-  void epsilon_closure(vector<long>& src) const;
   Fsa operator~() const;
-  // a -> a
-  void accessible(const vector<long>* starts, function<void(long)> relate);
-  // a -> a
-  void co_accessible(const vector<bool>* final, function<void(long)> relate);
-  // DFA -> DFA -> DFA
-  Fsa intersect(const Fsa& rhs, function<void(long, long)> relate) const;
-  // DFA -> DFA -> DFA
-  Fsa difference(const Fsa& rhs, function<void(long)> relate) const;
+  // relabel [0, AB) to equivalence classes [0, scale.size()-1), other labels are kept
+  void compress_labels(vector<long>& scale);
+  void decompress_labels(const vector<long>& scale);
+  // * -> * -> DFA. Operands are determinized lazily, only at subsets reachable in the product; `relate` is
+  // called with the subsets of each product state
+  Fsa intersect(const Fsa& rhs, function<void(const vector<long>&, const vector<long>&)> relate, bool trim = true) const;
+  // * -> * -> DFA
+  Fsa difference(const Fsa& rhs, function<void(const vector<long>&)> relate, bool trim = true) const;
+  // * -> DFA
+  Fsa determinize(const vector<long>* starts, function<void(long, const vector<long>&)> relate, long jobs = 1) const;
+};
+
+struct EdgeSpan {
+  const Edge *b, *e;
+  const Edge* begin() const { return b; }
+  const Edge* end() const { return e; }
+  long size() const { return e-b; }
+  bool empty() const { return b == e; }
+  const Edge& operator[](long i) const { return b[i]; }
+};
+
+// Compressed sparse row form of an automaton without epsilon edges, for the passes after determinization.
+// Edges of u are edges[off[u], off[u+1]); redges[roff[v], roff[v+1]) are the indices of the edges entering v.
+// Passes return new automata instead of modifying this one.
+struct FrozenFsa {
+  long start = 0;
+  vector<long> finals; // sorted
+  vector<long> off{0}, roff{0}, redges;
+  vector<Edge> edges;
+
+  FrozenFsa() = default;
+  // releases the edges of `fsa` as they are copied
+  explicit FrozenFsa(Fsa&& fsa);
+  Fsa thaw() const;
+  long n() const { return off.size()-1; }
+  EdgeSpan adj(long u) const { return {edges.data()+off[u], edges.data()+off[u+1]}; }
+  bool is_final(long x) const;
+  bool has_call(long u) const;
+  long transit(long u, long c) const;
+  // keeps states with id[u] >= 0 and renumbers them to id[u]; `relate` is called with old states in new order
+  FrozenFsa map_states(const vector<long>& id, function<void(long)> relate) const;
+  // labels are cut at `bound`
+  FrozenFsa truncate_labels(long bound) const;
+  FrozenFsa accessible(const vector<long>* starts, function<void(long)> relate) const;
+  FrozenFsa co_accessible(const vector<bool>* final, function<void(long)> relate) const;
   // DFA -> DFA
   Fsa distinguish(function<void(vector<long>&)> relate) const;
-  // * -> DFA
-  Fsa determinize(const vector<long>* starts, function<void(long, const vector<long>&)> relate) const;
+private:
+  void build_reverse();
+  template<class S>
+  FrozenFsa accessible_with(const vector<long>* starts, function<void(long)> relate) const;
+  template<class S>
+  FrozenFsa co_accessible_with(const vector<bool>* final, function<void(long)> relate) const;
+  template<class S>
+  Fsa distinguish_with(function<void(vector<long>&)> relate) const;
 };
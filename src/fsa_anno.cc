@@ -7,7 +7,10 @@
 #include <algorithm>
 #include <limits.h>
 #include <map>
+#include <mutex>
+#include <sysexits.h>
 #include <unicode/utf8.h>
+#include <unordered_map>
 #include <utility>
 using namespace std;
 
@@ -22,7 +25,7 @@ bool assoc_has_expr(vector<pair<Expr*, ExprTag>>& as, Expr* x)
   return it != as.end() && it->first == x;
 }
 
-void sort_assoc(vector<pair<Expr*, ExprTag>>& as)
+static void sort_assoc(AssocSet& as)
 {
   sort(ALL(as));
   auto i = as.begin(), j = i, k = i;
@@ -34,6 +37,85 @@ void sort_assoc(vector<pair<Expr*, ExprTag>>& as)
   as.erase(k, as.end());
 }
 
+//// Interned assoc sets
+
+namespace {
+// Sets live in chunks that never move, so assoc_set() reads without locking
+struct AssocPool {
+  static const long CHUNK = 1L << 16;
+  mutex mu;
+  AssocSet* chunks[(1L << 32)/CHUNK] = {};
+  long n = 1;
+  unordered_multimap<size_t, AssocId> index;
+  unordered_map<vector<AssocId>, AssocId, VectorHash> unions;
+  AssocPool() { chunks[0] = new AssocSet[CHUNK]; }
+};
+AssocPool pool;
+}
+
+static size_t hash_assoc(const AssocSet& as)
+{
+  size_t h = as.size();
+  for (auto& aa: as)
+    h = (h*1000003 ^ size_t(aa.first)) * 31 + long(aa.second);
+  return h;
+}
+
+const AssocSet& assoc_set(AssocId id)
+{
+  return pool.chunks[id/AssocPool::CHUNK][id%AssocPool::CHUNK];
+}
+
+AssocId assoc_intern(AssocSet& as)
+{
+  sort_assoc(as);
+  if (as.empty())
+    return 0;
+  size_t h = hash_assoc(as);
+  lock_guard<mutex> lock(pool.mu);
+  auto range = pool.index.equal_range(h);
+  for (auto it = range.first; it != range.second; ++it)
+    if (assoc_set(it->second) == as)
+      return it->second;
+  if (pool.n > UINT32_MAX)
+    err_exit(EX_SOFTWARE, "too many assoc sets");
+  AssocId id = pool.n++;
+  auto& chunk = pool.chunks[id/AssocPool::CHUNK];
+  if (! chunk)
+    chunk = new AssocSet[AssocPool::CHUNK];
+  chunk[id%AssocPool::CHUNK] = move(as);
+  pool.index.emplace(h, id);
+  return id;
+}
+
+AssocId assoc_union(vector<AssocId> ids)
+{
+  sort(ALL(ids));
+  ids.erase(unique(ALL(ids)), ids.end());
+  if (ids.size() && ids[0] == 0)
+    ids.erase(ids.begin());
+  if (ids.size() <= 1)
+    return ids.empty() ? 0 : ids[0];
+  {
+    lock_guard<mutex> lock(pool.mu);
+    auto it = pool.unions.find(ids);
+    if (it != pool.unions.end())
+      return it->second;
+  }
+  AssocSet as;
+  for (AssocId x: ids)
+    as.insert(as.end(), ALL(assoc_set(x)));
+  AssocId r = assoc_intern(as);
+  lock_guard<mutex> lock(pool.mu);
+  pool.unions.emplace(move(ids), r);
+  return r;
+}
+
+AssocId assoc_union(AssocId x, AssocId y)
+{
+  return assoc_union(vector<AssocId>{x, y});
+}
+
 void FsaAnno::add_assoc(Expr& expr)
 {
   // has actions: actions need tags to differentiate 'entering', 'leaving', ...
@@ -42,6 +124,7 @@ void FsaAnno::add_assoc(Expr& expr)
   // 'opt_mode': displaying possible positions for given strings in interactive mode
   if (expr.no_action() && ! expr.stmt->intact && ! dynamic_cast<CallExpr*>(&expr) && ! dynamic_cast<CollapseExpr*>(&expr) && opt_mode != Mode::interactive)
     return;
+  AssocId tagged[8] = {};
   auto j = fsa.finals.begin();
   REP(i, fsa.n()) {
     ExprTag tag = ExprTag(0);
@@ -53,7 +136,11 @@ void FsaAnno::add_assoc(Expr& expr)
       tag = ExprTag(long(tag) | long(ExprTag::final));
     if (tag == ExprTag(0))
       tag = ExprTag::inner;
-    sorted_insert(assoc[i], make_pair(&expr, tag));
+    if (! tagged[long(tag)]) {
+      AssocSet as{{&expr, tag}};
+      tagged[long(tag)] = assoc_intern(as);
+    }
+    assoc[i] = assoc_union(assoc[i], tagged[long(tag)]);
   }
   // Add pseudo transitions with labels [ACTION_LABEL_BASE, COLLAPSE_LABEL_BASE) to prevent its merge with other states
   if (expr.leaving.size() || expr.entering.size() || expr.transiting.size())
@@ -77,7 +164,7 @@ void FsaAnno::accessible(const vector<long>* starts, vector<long>& mapping) {
     allo++;
     mapping.push_back(x);
   };
-  fsa.accessible(starts, relate);
+  dfa = dfa.accessible(starts, relate);
   assoc.resize(allo);
 }
 
@@ -89,36 +176,129 @@ void FsaAnno::co_accessible(const vector<bool>* final, vector<long>& mapping) {
     allo++;
     mapping.push_back(x);
   };
-  fsa.co_accessible(final, relate);
-  if (fsa.finals.empty()) { // 'start' does not produce acceptable strings
-    assoc.assign(1, {});
+  dfa = dfa.co_accessible(final, relate);
+  if (dfa.finals.empty()) { // 'start' does not produce acceptable strings
+    assoc.assign(1, 0);
     mapping.assign(1, 0);
-    deterministic = true;
     return;
   }
-  if (! deterministic)
-    REP(i, fsa.n())
-      sort(ALL(fsa.adj[i]));
   assoc.resize(allo);
 }
 
+void FsaAnno::freeze() {
+  assert(deterministic);
+  dfa = FrozenFsa(move(fsa));
+  fsa = Fsa();
+}
+
+// UTF-8 byte sequences of codepoints [lo, hi], surrogates excluded. Each sequence is a list of byte ranges.
+static void utf8_sequences(long lo, long hi, vector<vector<Label>>& seqs)
+{
+  if (lo <= 0xdfff && 0xd800 <= hi) {
+    if (lo < 0xd800)
+      utf8_sequences(lo, 0xd7ff, seqs);
+    if (0xdfff < hi)
+      utf8_sequences(0xe000, hi, seqs);
+    return;
+  }
+  // same encoded length
+  for (long m: {0x7fL, 0x7ffL, 0xffffL})
+    if (lo <= m && m < hi) {
+      utf8_sequences(lo, m, seqs);
+      utf8_sequences(m+1, hi, seqs);
+      return;
+    }
+  if (hi <= 0x7f) {
+    seqs.push_back({{lo, hi+1}});
+    return;
+  }
+  // each continuation byte should range over [0x80,0xbf] unless the leading bytes are equal
+  FOR(i, 1, 4) {
+    long m = (1L << 6*i)-1;
+    if ((lo & ~m) != (hi & ~m)) {
+      if (lo & m) {
+        utf8_sequences(lo, lo | m, seqs);
+        utf8_sequences((lo | m)+1, hi, seqs);
+        return;
+      }
+      if ((hi & m) != m) {
+        utf8_sequences(lo, (hi & ~m)-1, seqs);
+        utf8_sequences(hi & ~m, hi, seqs);
+        return;
+      }
+    }
+  }
+  u8 a[4], b[4];
+  long i = 0, j = 0;
+  U8_APPEND_UNSAFE(a, i, lo);
+  U8_APPEND_UNSAFE(b, j, hi);
+  seqs.emplace_back();
+  REP(k, i)
+    seqs.back().emplace_back(a[k], b[k]+1);
+}
+
+// Byte-level automaton of UTF-8 encoded codepoints in `cps` and raw labels in `labels`.
+// Sequences sharing a suffix share states. If `star`, the start state is the only final state.
+static Fsa utf8_fsa(const vector<Label>& cps, const vector<Label>& labels, bool star)
+{
+  Fsa r;
+  long dst = star ? 0 : 1;
+  r.start = 0;
+  r.finals = {dst};
+  r.adj.resize(dst+1);
+  map<vector<Label>, long> suffix2state;
+  for (auto& x: cps) {
+    vector<vector<Label>> seqs;
+    utf8_sequences(x.first, x.second-1, seqs);
+    for (auto& seq: seqs) {
+      long v = dst;
+      for (long i = seq.size(); --i > 0; ) {
+        vector<Label> suffix(seq.begin()+i, seq.end());
+        auto it = suffix2state.find(suffix);
+        if (it == suffix2state.end()) {
+          it = suffix2state.emplace(suffix, r.n()).first;
+          r.adj.emplace_back();
+          r.adj.back().emplace_back(seq[i], v);
+        }
+        v = it->second;
+      }
+      r.adj[0].emplace_back(seq[0], v);
+    }
+  }
+  for (auto& x: labels)
+    r.adj[0].emplace_back(x, dst);
+  sort(ALL(r.adj[0]));
+  r = r.determinize(NULL, [](long, const vector<long>&){});
+  return FrozenFsa(move(r)).distinguish([](vector<long>&){});
+}
+
+// Products skip pairs that cannot reach a final pair. Keep them for --keep-inaccessible, and for
+// --substring-grammar where every inner state may end a substring
+static bool trim_products()
+{
+  return ! opt_keep_inaccessible && ! opt_substring_grammar;
+}
+
 void FsaAnno::complement(ComplementExpr* expr) {
   if (! deterministic)
     fsa = fsa.determinize(NULL, [&](long, const vector<long>&){});
   fsa = ~ fsa;
-  assoc.assign(fsa.n(), {});
+  // reject invalid UTF-8
+  if (opt_utf8) {
+    vector<Label> labels;
+    if (MAX_CODEPOINT+1 < AB)
+      labels.emplace_back(MAX_CODEPOINT+1, AB);
+    fsa = fsa.intersect(utf8_fsa({{0, MAX_CODEPOINT+1}}, labels, true), [](const vector<long>&, const vector<long>&){}, trim_products());
+  }
+  assoc.assign(fsa.n(), 0);
   deterministic = true;
 }
 
 void FsaAnno::concat(FsaAnno& rhs, ConcatExpr* expr) {
-  long ln = fsa.n(), rn = rhs.fsa.n();
+  long ln = fsa.n();
   for (long f: fsa.finals)
-    emplace_front(fsa.adj[f], epsilon, ln+rhs.fsa.start);
-  for (auto& es: rhs.fsa.adj) {
-    for (auto& e: es)
-      e.second += ln;
-    fsa.adj.emplace_back(move(es));
-  }
+    fsa.add_epsilon(f, ln+rhs.fsa.start);
+  fsa.append(rhs.fsa);
   fsa.finals = move(rhs.fsa.finals);
   for (long& f: fsa.finals)
     f += ln;
@@ -130,7 +310,7 @@ void FsaAnno::concat(FsaAnno& rhs, ConcatExpr* expr) {
   deterministic = false;
 }
 
-void FsaAnno::determinize(const vector<long>* starts, vector<vector<long>>* mapping) {
+void FsaAnno::determinize(const vector<long>* starts, vector<vector<long>>* mapping, long jobs) {
   if (deterministic)
     return;
   decltype(assoc) new_assoc;
@@ -140,42 +320,27 @@ void FsaAnno::determinize(const vector<long>* starts, vector<vector<long>>* mapp
       if (mapping)
         mapping->resize(id+1);
     }
-    auto& as = new_assoc[id];
+    vector<AssocId> ids;
     for (long x: xs)
-      as.insert(as.end(), ALL(assoc[x]));
-    sort_assoc(as);
+      ids.push_back(assoc[x]);
+    new_assoc[id] = assoc_union(move(ids));
     if (mapping)
       (*mapping)[id] = xs;
   };
-  fsa = fsa.determinize(starts, relate);
+  fsa = fsa.determinize(starts, relate, jobs);
   assoc = move(new_assoc);
   deterministic = true;
 }
 
 void FsaAnno::difference(FsaAnno& rhs, DifferenceExpr* expr) {
-  vector<vector<long>> rel0;
   decltype(rhs.assoc) new_assoc;
-  auto relate0 = [&](long id, const vector<long>& xs) {
-    if (id+1 > rel0.size())
-      rel0.resize(id+1);
-    rel0[id] = xs;
+  auto relate = [&](const vector<long>& xs) {
+    vector<AssocId> ids;
+    for (long u: xs)
+      ids.push_back(assoc[u]);
+    new_assoc.push_back(assoc_union(move(ids)));
   };
-  auto relate = [&](long x) {
-    if (rel0.empty())
-      new_assoc.emplace_back(assoc[x]);
-    else {
-      new_assoc.emplace_back();
-      auto& as = new_assoc.back();
-      for (long u: rel0[x])
-        as.insert(as.end(), ALL(assoc[u]));
-      sort_assoc(as);
-    }
-  };
-  if (! deterministic)
-    fsa = fsa.determinize(NULL, relate0);
-  if (! rhs.deterministic)
-    rhs.fsa = rhs.fsa.determinize(NULL, [](long, const vector<long>&) {});
-  fsa = fsa.difference(rhs.fsa, relate);
+  fsa = fsa.difference(rhs.fsa, relate, trim_products());
   assoc = move(new_assoc);
   if (expr)
     add_assoc(*expr);
@@ -196,37 +361,15 @@ FsaAnno FsaAnno::epsilon_fsa(EpsilonExpr* expr) {
 
 void FsaAnno::intersect(FsaAnno& rhs, IntersectExpr* expr) {
   decltype(rhs.assoc) new_assoc;
-  vector<vector<long>> rel0, rel1;
-  auto relate0 = [&](long id, const vector<long>& xs) {
-    if (id+1 > rel0.size())
-      rel0.resize(id+1);
-    rel0[id] = xs;
-  };
-  auto relate1 = [&](long id, const vector<long>& xs) {
-    if (id+1 > rel1.size())
-      rel1.resize(id+1);
-    rel1[id] = xs;
-  };
-  auto relate = [&](long x, long y) {
-    new_assoc.emplace_back();
-    auto& as = new_assoc.back();
-    if (rel0.empty())
-      as.insert(as.end(), ALL(assoc[x]));
-    else
-      for (long u: rel0[x])
-        as.insert(as.end(), ALL(assoc[u]));
-    if (rel1.empty())
-      as.insert(as.end(), ALL(rhs.assoc[y]));
-    else
-      for (long v: rel1[y])
-        as.insert(as.end(), ALL(rhs.assoc[v]));
-    sort_assoc(as);
+  auto relate = [&](const vector<long>& xs, const vector<long>& ys) {
+    vector<AssocId> ids;
+    for (long u: xs)
+      ids.push_back(assoc[u]);
+    for (long v: ys)
+      ids.push_back(rhs.assoc[v]);
+    new_assoc.push_back(assoc_union(move(ids)));
   };
-  if (! deterministic)
-    fsa = fsa.determinize(NULL, relate0);
-  if (! rhs.deterministic)
-    rhs.fsa = rhs.fsa.determinize(NULL, relate1);
-  fsa = fsa.intersect(rhs.fsa, relate);
+  fsa = fsa.intersect(rhs.fsa, relate, trim_products());
   assoc = move(new_assoc);
   if (expr)
     add_assoc(*expr);
@@ -237,15 +380,14 @@ void FsaAnno::minimize(vector<vector<long>>* mapping) {
   assert(deterministic);
   decltype(assoc) new_assoc;
   auto relate = [&](vector<long>& xs) {
-    new_assoc.emplace_back();
-    auto& as = new_assoc.back();
+    vector<AssocId> ids;
     for (long x: xs)
-      as.insert(as.end(), ALL(assoc[x]));
-    sort_assoc(as);
+      ids.push_back(assoc[x]);
+    new_assoc.push_back(assoc_union(move(ids)));
     if (mapping)
       mapping->push_back(xs);
   };
-  fsa = fsa.distinguish(relate);
+  fsa = FrozenFsa(move(fsa)).distinguish(relate);
   assoc = move(new_assoc);
 }
 
@@ -255,14 +397,10 @@ void FsaAnno::union_(FsaAnno& rhs, UnionExpr* expr) {
   fsa.start = src;
   for (long f: rhs.fsa.finals)
     fsa.finals.push_back(ln+f);
-  for (auto& es: rhs.fsa.adj) {
-    for (auto& e: es)
-      e.second += ln;
-    fsa.adj.emplace_back(move(es));
-  }
+  fsa.append(rhs.fsa);
   fsa.adj.emplace_back();
-  fsa.adj[src].emplace_back(epsilon, old_lsrc);
-  fsa.adj[src].emplace_back(epsilon, ln+rhs.fsa.start);
+  fsa.add_epsilon(src, old_lsrc);
+  fsa.add_epsilon(src, ln+rhs.fsa.start);
   assoc.resize(fsa.n());
   REP(i, rhs.fsa.n())
     assoc[ln+i] = move(rhs.assoc[i]);
@@ -273,7 +411,7 @@ void FsaAnno::union_(FsaAnno& rhs, UnionExpr* expr) {
 
 void FsaAnno::plus(PlusExpr* expr) {
   for (long f: fsa.finals)
-    emplace_front(fsa.adj[f], epsilon, fsa.start);
+    fsa.add_epsilon(f, fsa.start);
   if (expr)
     add_assoc(*expr);
   deterministic = false;
@@ -284,8 +422,8 @@ void FsaAnno::question(QuestionExpr* expr) {
   fsa.start = src;
   fsa.adj.emplace_back();
   fsa.adj.emplace_back();
-  fsa.adj[src].emplace_back(epsilon, old_src);
-  fsa.adj[src].emplace_back(epsilon, sink);
+  fsa.add_epsilon(src, old_src);
+  fsa.add_epsilon(src, sink);
   fsa.finals.push_back(sink);
   assoc.resize(fsa.n());
   if (expr)
@@ -293,29 +431,69 @@ void FsaAnno::question(QuestionExpr* expr) {
   deterministic = false;
 }
 
+// The inner automaton is determinized once, then copied: finals of a copy take over the edges and assoc of the
+// next start instead of epsilon edges; if unbounded, finals of the last copy take over those of its own start.
+// The merged edges may overlap, so the chain is determinized.
 void FsaAnno::repeat(RepeatExpr& expr) {
-  FsaAnno r = epsilon_fsa(NULL);
-  REP(i, expr.low) {
-    FsaAnno t = *this;
-    r.concat(t, NULL);
+  if (expr.high == 0) {
+    *this = epsilon_fsa(NULL);
+    return;
   }
-  if (expr.high == LONG_MAX) {
-    star(NULL);
-    r.concat(*this, NULL);
-  } else if (expr.low < expr.high) {
-    FsaAnno rhs = epsilon_fsa(NULL), x = *this;
-    ROF(i, 0, expr.high-expr.low) {
-      FsaAnno t = x;
-      rhs.union_(t, NULL);
-      if (i) {
-        t = *this;
-        x.concat(t, NULL);
-      }
+  determinize(NULL, NULL);
+  // merging states would merge their assoc, changing which actions are triggered
+  if (all_of(ALL(assoc), [](AssocId as) { return as == 0; }))
+    minimize(NULL);
+  long m = fsa.n(), s = fsa.start, low = expr.low;
+  if (fsa.is_final(s)) // X{low,high} = X{0,high} if X contains the empty string
+    low = 0;
+  bool loop = expr.high == LONG_MAX;
+  long copies = loop ? max(low, 1L) : expr.high;
+  Fsa r;
+  r.start = s;
+  r.adj.resize(m*copies);
+  assoc.resize(m*copies);
+  REP(k, copies) {
+    REP(i, m) {
+      for (auto& e: fsa.adj[i])
+        r.adj[k*m+i].emplace_back(e.first, k*m+e.second);
+      if (k)
+        assoc[k*m+i] = assoc[i];
     }
-    r.concat(rhs, NULL);
+    if (k >= low-1)
+      for (long f: fsa.finals)
+        r.finals.push_back(k*m+f);
   }
-  r.deterministic = false;
-  *this = move(r);
+  auto take_over = [&](long u, long v) {
+    vector<Edge> es;
+    merge(ALL(r.adj[u]), ALL(r.adj[v]), back_inserter(es));
+    es.erase(unique(ALL(es)), es.end());
+    r.adj[u] = move(es);
+    assoc[u] = assoc_union(assoc[u], assoc[v]);
+  };
+  if (loop)
+    for (long f: fsa.finals)
+      if (f != s)
+        take_over((copies-1)*m+f, (copies-1)*m+s);
+  ROF(k, 0, copies-1)
+    for (long f: fsa.finals)
+      take_over(k*m+f, (k+1)*m+s);
+  if (low == 0 && ! fsa.is_final(s)) {
+    bool entered = false;
+    for (auto& es: r.adj)
+      for (auto& e: es)
+        if (e.second == s)
+          entered = true;
+    if (entered) {
+      r.start = r.n();
+      r.adj.push_back(r.adj[s]);
+      assoc.push_back(assoc[s]);
+    }
+    r.finals.push_back(r.start);
+  }
+  sort(ALL(r.finals));
+  fsa = move(r);
+  deterministic = false;
+  determinize(NULL, NULL);
 }
 
 void FsaAnno::star(StarExpr* expr) {
@@ -323,11 +501,11 @@ void FsaAnno::star(StarExpr* expr) {
   fsa.start = src;
   fsa.adj.emplace_back();
   fsa.adj.emplace_back();
-  fsa.adj[src].emplace_back(epsilon, old_src);
-  fsa.adj[src].emplace_back(epsilon, sink);
+  fsa.add_epsilon(src, old_src);
+  fsa.add_epsilon(src, sink);
   for (long f: fsa.finals) {
-    sorted_emplace(fsa.adj[f], epsilon, old_src);
-    sorted_emplace(fsa.adj[f], epsilon, sink);
+    fsa.add_epsilon(f, old_src);
+    fsa.add_epsilon(f, sink);
   }
   fsa.finals.assign(1, sink);
   assoc.resize(fsa.n());
@@ -338,12 +516,23 @@ void FsaAnno::star(StarExpr* expr) {
 
 FsaAnno FsaAnno::bracket(BracketExpr& expr) {
   FsaAnno r;
-  r.fsa.start = 0;
-  r.fsa.finals = {1};
-  r.fsa.adj.resize(2);
-  for (auto& x: expr.intervals.to)
-    r.fsa.adj[0].emplace_back(x, 1);
-  r.assoc.resize(2);
+  if (opt_utf8) {
+    vector<Label> cps, labels;
+    for (auto& x: expr.intervals.to) {
+      if (x.first <= MAX_CODEPOINT)
+        cps.emplace_back(x.first, min(x.second, MAX_CODEPOINT+1));
+      if (MAX_CODEPOINT+1 < x.second)
+        labels.emplace_back(max(x.first, MAX_CODEPOINT+1), x.second);
+    }
+    r.fsa = utf8_fsa(cps, labels, false);
+  } else {
+    r.fsa.start = 0;
+    r.fsa.finals = {1};
+    r.fsa.adj.resize(2);
+    for (auto& x: expr.intervals.to)
+      r.fsa.adj[0].emplace_back(x, 1);
+  }
+  r.assoc.resize(r.fsa.n());
   r.add_assoc(expr);
   r.deterministic = true;
   return r;
@@ -379,11 +568,18 @@ FsaAnno FsaAnno::collapse(CollapseExpr& expr) {
 
 FsaAnno FsaAnno::dot(DotExpr* expr) {
   FsaAnno r;
-  r.fsa.start = 0;
-  r.fsa.finals = {1};
-  r.fsa.adj.resize(2);
-  r.fsa.adj[0].emplace_back(make_pair(0L, AB), 1);
-  r.assoc.resize(2);
+  if (opt_utf8) {
+    vector<Label> labels;
+    if (MAX_CODEPOINT+1 < AB)
+      labels.emplace_back(MAX_CODEPOINT+1, AB);
+    r.fsa = utf8_fsa({{0, MAX_CODEPOINT+1}}, labels, false);
+  } else {
+    r.fsa.start = 0;
+    r.fsa.finals = {1};
+    r.fsa.adj.resize(2);
+    r.fsa.adj[0].emplace_back(make_pair(0L, AB), 1);
+  }
+  r.assoc.resize(r.fsa.n());
   if (expr)
     r.add_assoc(*expr);
   r.deterministic = true;
@@ -392,19 +588,18 @@ FsaAnno FsaAnno::dot(DotExpr* expr) {
 
 FsaAnno FsaAnno::embed(EmbedExpr& expr) {
   if (expr.define_stmt) {
-    FsaAnno r = compiled[expr.define_stmt];
+    FsaAnno r = compiled.at(expr.define_stmt);
     // change the labels to differentiate instances of CallExpr
     REP(i, r.fsa.n()) {
       auto it = upper_bound(ALL(r.fsa.adj[i]), make_pair(make_pair(call_label_base, LONG_MAX), LONG_MAX));
       if (it != r.fsa.adj[i].begin() && call_label_base < (it-1)->first.second)
         --it;
-      for (; it != r.fsa.adj[i].end() && it->first.first < call_label; ++it) {
+      for (; it != r.fsa.adj[i].end() && it->first.first < collapse_label_base; ++it) {
         assert(call_label_base <= it->first.first);
         long t = it->first.second-it->first.first;
         it->first.first = call_label;
         call_label += t;
         it->first.second = call_label;
-        assert(it->first.second <= call_label);
       }
     }
     r.add_assoc(expr);
@@ -426,11 +621,22 @@ FsaAnno FsaAnno::literal(LiteralExpr& expr) {
   FsaAnno r;
   r.fsa.start = 0;
   long len = 0;
-  if (opt_bytes) {
-    len = expr.literal.size();
+  if (opt_bytes || opt_utf8) {
+    string bytes;
+    if (opt_utf8) // re-encode to replace invalid sequences with U+FFFD
+      for (i32 c, i = 0; i < expr.literal.size(); ) {
+        u8 t[4];
+        long j = 0;
+        U8_NEXT_OR_FFFD(expr.literal.c_str(), i, expr.literal.size(), c);
+        U8_APPEND_UNSAFE(t, j, c);
+        bytes.append((const char*)t, j);
+      }
+    else
+      bytes = expr.literal;
+    len = bytes.size();
     r.fsa.adj.resize(len+1);
-    REP(i, expr.literal.size()) {
-      long c = (u8)expr.literal[i];
+    REP(i, len) {
+      long c = (u8)bytes[i];
       r.fsa.adj[i].emplace_back(make_pair(c, c+1), i+1);
     }
   } else {
@@ -455,7 +661,7 @@ void FsaAnno::substring_grammar() {
   fsa.adj.emplace_back();
   REP(i, src) {
     bool ok = true;
-    for (auto aa: assoc[i])
+    for (auto aa: assoc_set(assoc[i]))
       if (auto e = dynamic_cast<CollapseExpr*>(aa.first)) {
         if (e->define_stmt->intact && has_inner(aa.second)) {
           ok = false;
@@ -465,10 +671,17 @@ void FsaAnno::substring_grammar() {
         ok = false;
         break;
       }
+    // do not start or stop in the middle of a UTF-8 sequence
+    if (ok && opt_utf8)
+      for (auto& e: fsa.adj[i])
+        if (e.first.first < 0xc0 && 0x80 < e.first.second) {
+          ok = false;
+          break;
+        }
     if (ok || i == old_src)
-      fsa.adj[src].emplace_back(epsilon, i);
+      fsa.add_epsilon(src, i);
     if (ok || fsa.is_final(i))
-      emplace_front(fsa.adj[i], epsilon, sink);
+      fsa.add_epsilon(i, sink);
   }
   fsa.finals.assign(1, sink);
   assoc.resize(fsa.n());
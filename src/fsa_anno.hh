@@ -15,16 +15,27 @@ extern inline bool has_final(ExprTag x) { return long(x) & long(ExprTag::final);
 bool operator<(ExprTag x, ExprTag y);
 bool assoc_has_expr(vector<pair<Expr*, ExprTag>>& as, const Expr* x);
 
+// Assoc sets are interned: a state holds the id of a set of (Expr, ExprTag) sorted by Expr, with the tags of an Expr
+// merged. Sets are never freed and id 0 is the empty set. Thread-safe.
+typedef uint32_t AssocId;
+typedef vector<pair<Expr*, ExprTag>> AssocSet;
+const AssocSet& assoc_set(AssocId id);
+AssocId assoc_intern(AssocSet& as);
+AssocId assoc_union(vector<AssocId> ids);
+AssocId assoc_union(AssocId x, AssocId y);
+
 struct FsaAnno {
   bool deterministic;
   Fsa fsa;
-  vector<vector<pair<Expr*, ExprTag>>> assoc;
+  FrozenFsa dfa; // compile_export moves `fsa` here once construction ends
+  vector<AssocId> assoc;
   void accessible(const vector<long>* starts, vector<long>& mapping);
   void add_assoc(Expr& expr);
   void complement(ComplementExpr* expr);
   void co_accessible(const vector<bool>* final, vector<long>& mapping);
+  void freeze();
   void concat(FsaAnno& rhs, ConcatExpr* expr);
-  void determinize(const vector<long>* starts, vector<vector<long>>* mapping);
+  void determinize(const vector<long>* starts, vector<vector<long>>* mapping, long jobs = 1);
   void difference(FsaAnno& rhs, DifferenceExpr* expr);
   void intersect(FsaAnno& rhs, IntersectExpr* expr);
   void minimize(vector<vector<long>>* mapping);
@@ -177,7 +177,8 @@ struct ModuleUse : PrePostActionExprStmtVisitor {
 
   void visit(BracketExpr& expr) override {
     for (auto& x: expr.intervals.to)
-      AB = max(AB, x.second);
+      if (! opt_utf8 || MAX_CODEPOINT+1 < x.second)
+        AB = max(AB, x.second);
   }
   void visit(CallExpr& expr) override {
     Stmt* r = resolve(mo, expr.qualified, expr.ident);
@@ -311,6 +312,29 @@ Module* load_module(long& n_errors, const string& filename)
   return &mo;
 }
 
+// `stmt` followed by DefineStmt reachable via EmbedExpr (and CallExpr/CollapseExpr if `calls`), in preorder
+vector<DefineStmt*> reachable_define_stmts(DefineStmt* stmt, bool calls)
+{
+  struct Deps : PrePostActionExprStmtVisitor {
+    bool calls;
+    vector<DefineStmt*> out;
+    unordered_map<DefineStmt*, bool> vis;
+    void add(DefineStmt* x) {
+      if (x && ! vis[x]) {
+        vis[x] = true;
+        out.push_back(x);
+        PrePostActionExprStmtVisitor::visit(*x->rhs);
+      }
+    }
+    void visit(CallExpr& expr) override { if (calls) add(expr.define_stmt); }
+    void visit(CollapseExpr& expr) override { if (calls) add(expr.define_stmt); }
+    void visit(EmbedExpr& expr) override { add(expr.define_stmt); }
+  } p;
+  p.calls = calls;
+  p.add(stmt);
+  return p.out;
+}
+
 static vector<DefineStmt*> topo_define_stmts(long& n_errors)
 {
   vector<DefineStmt*> topo;
@@ -394,6 +418,10 @@ long load(const string& filename)
   if (n_errors)
     return n_errors;
 
+  // codepoints are compiled to UTF-8 bytes, labels above MAX_CODEPOINT and macros are kept
+  if (opt_utf8)
+    AB = 256;
+
   DP(1, "Processing use");
   for (auto& it: inode2module)
     if (it.second.status == GOOD) {
@@ -476,13 +504,24 @@ long load(const string& filename)
     return 0;
 
   // AB has been updated by ModuleUse
-  action_label_base = action_label = AB;
-  call_label_base = call_label = action_label+1000000;
-  collapse_label_base = collapse_label = call_label+1000000;
+  action_label_base = AB;
+  call_label_base = action_label_base+LABEL_BLOCK*long(topo.size());
+  collapse_label_base = call_label_base+LABEL_BLOCK*long(topo.size());
 
   DP(1, "Compiling DefineStmt");
-  for (auto stmt: topo)
-    compile(stmt);
+  fsa_limit_exceeded = limit_exceeded;
+  {
+    unordered_map<DefineStmt*, long> stmt2idx;
+    vector<vector<long>> succ(topo.size());
+    REP(i, topo.size()) {
+      stmt2idx[topo[i]] = i;
+      compiled[topo[i]]; // inserted here, compile() and compile_export() run concurrently
+    }
+    REP(i, topo.size())
+      for (auto v: depended_by[topo[i]])
+        succ[i].push_back(stmt2idx[v]);
+    run_dag(succ, opt_jobs, [&](long i) { compile(topo[i], i); });
+  }
 
   output = strcmp(opt_output_filename, "-") ? fopen(opt_output_filename, "w") : stdout;
   if (! output) {
@@ -491,12 +530,15 @@ long load(const string& filename)
     return n_errors;
   }
 
-  unordered_map<DefineStmt*, vector<pair<long, long>>> stmt2call_addr;
   DP(1, "Compiling exporting DefineStmt (coalescing referenced CallExpr/CollapseExpr)");
-  for (Stmt* x = main_module->toplevel; x; x = x->next)
-    if (auto xx = dynamic_cast<DefineStmt*>(x))
-      if (xx->export_ && ! compile_export(xx))
-        n_errors++;
+  {
+    vector<DefineStmt*> exports;
+    for (Stmt* x = main_module->toplevel; x; x = x->next)
+      if (auto xx = dynamic_cast<DefineStmt*>(x))
+        if (xx->export_)
+          exports.push_back(xx);
+    n_errors += compile_exports(exports);
+  }
   if (n_errors)
     return n_errors;
 
@@ -505,7 +547,7 @@ long load(const string& filename)
       if (xx->export_) {
         FsaAnno& anno = compiled[xx];
         if (opt_dump_automaton)
-          print_automaton(anno.fsa);
+          print_automaton(anno.dfa.thaw());
         if (opt_dump_assoc)
           print_assoc(anno);
       }
@@ -523,6 +565,9 @@ long load(const string& filename)
     generate_cxx(mo);
     if (output_header)
       fclose(output_header);
+  } else if (opt_mode == Mode::binary) {
+    DP(1, "Generating binary automata");
+    generate_binary(mo);
   } else if (opt_mode == Mode::graphviz) {
     DP(1, "Generating Graphviz dot");
     generate_graphviz(mo);
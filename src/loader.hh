@@ -27,6 +27,7 @@ struct Module {
 };
 
 Stmt* resolve(Module& mo, const string qualified, const string& ident);
+vector<DefineStmt*> reachable_define_stmts(DefineStmt* stmt, bool calls);
 long load(const string& filename);
 Module* load_module(long& n_errors, const string& filename);
 void unload_all();
@@ -2,12 +2,14 @@
 #include "fsa.hh"
 #include "loader.hh"
 #include "option.hh"
+#include "profile.hh"
 
 #include <errno.h>
 #include <getopt.h>
 #include <locale.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <string>
 #include <sysexits.h>
@@ -21,24 +23,35 @@ void print_help(FILE *fh)
         "\n"
         "Options:\n"
         "  -b,--bytes                make labels range over [0,256), Unicode literals will be treated as UTF-8 bytes\n"
+        "  --cache-dir <dir>         reuse automata of unchanged DefineStmt from <dir>\n"
+        "  --backend <backend>       code generation backend of transition functions: 'switch' (default), 'table' (compressed transition tables)\n"
         "  -C                        generate C source code (default: C++)\n"
         "  --check                   check syntax & use/def\n"
         "  --debug                   debug level\n"
         "  --debug-output            filename for debug output\n"
+        "  --derivatives             build the DFA of a DefineStmt without actions/CallExpr/CollapseExpr from Brzozowski derivatives\n"
         "  --dump-action             dump associated actions for each edge\n"
         "  --dump-assoc              dump associated AST Expr for each state\n"
         "  --dump-automaton          dump automata\n"
         "  --dump-embed              dump statistics of EmbedExpr\n"
         "  --dump-module             dump module use/def/...\n"
         "  --dump-tree               dump AST\n"
+        "  --early-minimize <n>[,e]  determinize and minimize the automaton of a subexpression without actions once it has <n> states or e epsilon edges per state\n"
+        "  --emit-binary             output automata of exports in the mmap-able binary format (src/binary_format.hh)\n"
         "  --extern-c                generate extern \"C\" specifier\n"
         "  -G,--graph <dir>          output a Graphviz dot file\n"
         "  -I,--import <dir>         add <dir> to search path for 'import'\n"
         "  -i,--interactive          interactive mode\n"
+        "  -j,--jobs <n>             number of threads for compiling DefineStmt and exports (default: 1)\n"
+        "  --max-memory <MiB>        abort when peak RSS exceeds <MiB> during determinization/intersection/difference\n"
         "  --max-return-stack        max length of return stack in C generator (default: 100)\n"
+        "  --max-states <n>          abort when determinization/intersection/difference produces more than <n> states\n"
         "  -k,--keep-inaccessible    do not perform accessible/co-accessible\n"
+        "  --profile                 print wall time, automaton sizes and peak RSS of each phase of each DefineStmt/export\n"
+        "  --profile-trace <file>    --profile and write the phases as Chrome trace event JSON to <file>\n"
         "  -S,--standalone           generate header and 'main()'\n"
         "  --substring-grammar       construct regular approximation of the substring grammar. Inner states of nonterminals labeled 'intact' are not connected to start/final\n"
+        "  --utf8                    compile Unicode codepoints to UTF-8 byte sequences, the generated automaton consumes bytes and rejects invalid UTF-8\n"
         "  -o,--output <file>        .cc output filename\n"
         "  -O,--output-header <file> .hh output filename\n"
         "  -h, --help                display this help and exit\n"
@@ -52,31 +65,42 @@ int main(int argc, char *argv[])
   setlocale(LC_ALL, "");
   int opt;
   static struct option long_options[] = {
+    {"backend",             required_argument, 0,   1008},
     {"bytes",               no_argument,       0,   'b'},
+    {"cache-dir",           required_argument, 0,   1010},
     {"check",               required_argument, 0,   'c'},
     {"debug",               required_argument, 0,   'd'},
     {"debug-output",        required_argument, 0,   'l'},
+    {"derivatives",         no_argument,       0,   1017},
     {"dump-action",         no_argument,       0,   1000},
     {"dump-assoc",          no_argument,       0,   1001},
     {"dump-automaton",      no_argument,       0,   1002},
     {"dump-embed",          no_argument,       0,   1003},
     {"dump-module",         no_argument,       0,   1004},
     {"dump-tree",           no_argument,       0,   1005},
+    {"early-minimize",      required_argument, 0,   1018},
+    {"emit-binary",         no_argument,       0,   1011},
     {"extern-c",            no_argument,       0,   1007},
     {"graph",               no_argument,       0,   'G'},
     {"import",              required_argument, 0,   'I'},
     {"interactive",         no_argument,       0,   'i'},
+    {"jobs",                required_argument, 0,   'j'},
+    {"max-memory",          required_argument, 0,   1015},
     {"max-return-stack",    required_argument, 0,   1006},
+    {"max-states",          required_argument, 0,   1014},
     {"keep-inaccessible",   no_argument,       0,   'k'},
+    {"profile",             no_argument,       0,   1012},
+    {"profile-trace",       required_argument, 0,   1013},
     {"standalone",          no_argument,       0,   'S'},
     {"substring-grammar",   no_argument,       0,   's'},
+    {"utf8",                no_argument,       0,   1009},
     {"output",              required_argument, 0,   'o'},
     {"output-header",       required_argument, 0,   'O'},
     {"help",                no_argument,       0,   'h'},
     {0,                     0,                 0,   0},
   };
 
-  while ((opt = getopt_long(argc, argv, "bCDcd:GhI:ikl:O:o:Ss", long_options, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "bCDcd:GhI:ij:kl:O:o:Ss", long_options, NULL)) != -1) {
     switch (opt) {
     case 'b':
       opt_bytes = true;
@@ -105,6 +129,11 @@ int main(int argc, char *argv[])
     case 'i':
       opt_mode = Mode::interactive;
       break;
+    case 'j':
+      opt_jobs = get_long(optarg);
+      if (opt_jobs < 1)
+        err_exit(EX_USAGE, "invalid number of jobs: %s", optarg);
+      break;
     case 'k':
       opt_keep_inaccessible = true;
       break;
@@ -137,17 +166,60 @@ int main(int argc, char *argv[])
       opt_max_return_stack = get_long(optarg);
       break;
     case 1007: opt_gen_extern_c = true; break;
+    case 1008:
+      if (! strcmp(optarg, "switch"))
+        opt_backend = Backend::switch_;
+      else if (! strcmp(optarg, "table"))
+        opt_backend = Backend::table;
+      else
+        err_exit(EX_USAGE, "unknown backend: %s", optarg);
+      break;
+    case 1009: opt_utf8 = true; break;
+    case 1010:
+      opt_cache_dir = optarg;
+      break;
+    case 1011:
+      opt_mode = Mode::binary;
+      break;
+    case 1012: opt_profile = true; break;
+    case 1013:
+      opt_profile = true;
+      opt_profile_trace = optarg;
+      break;
+    case 1014:
+      opt_max_states = get_long(optarg);
+      if (opt_max_states < 1)
+        err_exit(EX_USAGE, "invalid --max-states: %s", optarg);
+      break;
+    case 1015:
+      opt_max_memory = get_long(optarg);
+      if (opt_max_memory < 1)
+        err_exit(EX_USAGE, "invalid --max-memory: %s", optarg);
+      break;
+    case 1017: opt_derivatives = true; break;
+    case 1018: {
+      char* end;
+      opt_early_minimize = strtol(optarg, &end, 10);
+      if (*end == ',')
+        opt_early_minimize_eps = strtod(end+1, &end);
+      if (*end || opt_early_minimize < 0 || opt_early_minimize_eps < 0 || (! opt_early_minimize && ! opt_early_minimize_eps))
+        err_exit(EX_USAGE, "invalid --early-minimize: %s", optarg);
+      break;
+    }
     case '?':
       print_help(stderr);
       break;
     }
   }
+  if (opt_bytes && opt_utf8)
+    err_exit(EX_USAGE, "'-b' and '--utf8' are mutually exclusive");
   if (! debug_file)
     debug_file = stderr;
   argc -= optind;
   argv += optind;
 
   long n_errors = load(argc ? argv[0] : "-");
+  profile_report();
   unload_all();
   fclose(debug_file);
   return n_errors ? 2 : 0;
@@ -2,12 +2,16 @@
 #include "option.hh"
 #include <stdio.h>
 
-bool opt_bytes, opt_check, opt_dump_action, opt_dump_assoc, opt_dump_automaton, opt_dump_embed, opt_dump_module, opt_dump_tree, opt_gen_c, opt_gen_extern_c, opt_keep_inaccessible, opt_standalone, opt_substring_grammar;
+bool opt_bytes, opt_check, opt_derivatives, opt_dump_action, opt_dump_assoc, opt_dump_automaton, opt_dump_embed, opt_dump_module, opt_dump_tree, opt_gen_c, opt_gen_extern_c, opt_keep_inaccessible, opt_profile, opt_standalone, opt_substring_grammar, opt_utf8;
 
-long AB = MAX_CODEPOINT+1, opt_max_return_stack = 100;
+long AB = MAX_CODEPOINT+1, opt_early_minimize, opt_jobs = 1, opt_max_memory, opt_max_return_stack = 100, opt_max_states;
 long debug_level = 3;
 FILE* debug_file;
+double opt_early_minimize_eps;
+const char* opt_cache_dir;
 const char* opt_output_filename = "-";
 const char* opt_output_header_filename;
+const char* opt_profile_trace;
 Mode opt_mode = Mode::cxx;
+Backend opt_backend = Backend::switch_;
 vector<string> opt_include_paths;
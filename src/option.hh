@@ -4,10 +4,15 @@
 using std::string;
 using std::vector;
 
-extern bool opt_bytes, opt_check, opt_dump_action, opt_dump_assoc, opt_dump_automaton, opt_dump_embed, opt_dump_module, opt_dump_tree, opt_gen_c, opt_gen_extern_c, opt_keep_inaccessible, opt_standalone, opt_substring_grammar;
-extern long AB, opt_max_return_stack;
+extern bool opt_bytes, opt_check, opt_derivatives, opt_dump_action, opt_dump_assoc, opt_dump_automaton, opt_dump_embed, opt_dump_module, opt_dump_tree, opt_gen_c, opt_gen_extern_c, opt_keep_inaccessible, opt_profile, opt_standalone, opt_substring_grammar, opt_utf8;
+extern long AB, opt_early_minimize, opt_jobs, opt_max_memory, opt_max_return_stack, opt_max_states;
+extern double opt_early_minimize_eps;
+extern const char* opt_cache_dir;
 extern const char* opt_output_filename;
 extern const char* opt_output_header_filename;
-enum class Mode {cxx, graphviz, interactive};
+extern const char* opt_profile_trace;
+enum class Mode {binary, cxx, graphviz, interactive};
 extern Mode opt_mode;
+enum class Backend {switch_, table};
+extern Backend opt_backend;
 extern vector<string> opt_include_paths;
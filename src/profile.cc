@@ -0,0 +1,147 @@
+#include "common.hh"
+#include "loader.hh"
+#include "option.hh"
+#include "profile.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <sys/resource.h>
+#include <sysexits.h>
+#include <time.h>
+using namespace std;
+
+struct Event {
+  string stmt;
+  const char* category;
+  const char* phase;
+  long tid, start, dur; // microseconds
+  long states0, edges0, states, edges, assoc, peak_rss;
+};
+
+static mutex mu;
+static vector<Event> events;
+static atomic<long> n_threads(0);
+
+static long now()
+{
+  static const timespec t0 = []() { timespec t; clock_gettime(CLOCK_MONOTONIC, &t); return t; }();
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (t.tv_sec-t0.tv_sec)*1000000+(t.tv_nsec-t0.tv_nsec)/1000;
+}
+
+static long n_states(const FsaAnno& anno)
+{
+  return anno.dfa.n() ? anno.dfa.n() : anno.fsa.n();
+}
+
+static long n_edges(const FsaAnno& anno)
+{
+  if (anno.dfa.n())
+    return anno.dfa.edges.size();
+  long r = 0;
+  for (auto& es: anno.fsa.adj)
+    r += es.size();
+  for (auto& vs: anno.fsa.eps)
+    r += vs.size();
+  return r;
+}
+
+Profiler::Profiler(DefineStmt* stmt, const char* category, const FsaAnno& anno) : stmt(stmt), category(category), anno(anno) {}
+
+void Profiler::begin(const char* phase)
+{
+  end();
+  if (! opt_profile)
+    return;
+  this->phase = phase;
+  start = now();
+  states = n_states(anno);
+  edges = n_edges(anno);
+}
+
+void Profiler::end()
+{
+  if (! phase)
+    return;
+  static thread_local long tid = n_threads++;
+  Event e;
+  e.stmt = stmt->module->filename+"::"+stmt->lhs;
+  e.category = category;
+  e.phase = phase;
+  e.tid = tid;
+  e.start = start;
+  e.dur = now()-start;
+  e.states0 = states;
+  e.edges0 = edges;
+  e.states = n_states(anno);
+  e.edges = n_edges(anno);
+  e.assoc = 0;
+  for (AssocId as: anno.assoc)
+    e.assoc += assoc_set(as).size();
+  rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  e.peak_rss = ru.ru_maxrss;
+  phase = nullptr;
+  lock_guard<mutex> lock(mu);
+  events.push_back(move(e));
+}
+
+static void json_string(FILE* f, const string& s)
+{
+  fputc('"', f);
+  for (unsigned char c: s)
+    if (c == '"' || c == '\\')
+      fprintf(f, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(f, "\\u%04x", c);
+    else
+      fputc(c, f);
+  fputc('"', f);
+}
+
+static void write_trace(const char* filename)
+{
+  FILE* f = fopen(filename, "w");
+  if (! f)
+    err_exit(EX_OSFILE, "fopen", filename);
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", f);
+  REP(i, events.size()) {
+    auto& e = events[i];
+    fputs(i ? ",\n" : "\n", f);
+    fputs("{\"name\":", f);
+    json_string(f, e.phase);
+    fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%ld,\"ts\":%ld,\"dur\":%ld,\"args\":{\"DefineStmt\":", e.category, e.tid, e.start, e.dur);
+    json_string(f, e.stmt);
+    fprintf(f, ",\"states\":[%ld,%ld],\"edges\":[%ld,%ld],\"assoc\":%ld,\"peak_rss_kb\":%ld}}", e.states0, e.states, e.edges0, e.edges, e.assoc, e.peak_rss);
+  }
+  fputs("\n]}\n", f);
+  fclose(f);
+}
+
+void profile_report()
+{
+  if (! opt_profile)
+    return;
+  sort(ALL(events), [](const Event& x, const Event& y) { return x.dur != y.dur ? x.dur > y.dur : x.start < y.start; });
+  map<pair<string, string>, pair<long, long>> totals;
+  for (auto& e: events) {
+    auto& t = totals[{e.category, e.phase}];
+    t.first++;
+    t.second += e.dur;
+  }
+  magenta(2); fputs("=== Profile\n", stderr); sgr0(2);
+  fprintf(stderr, "%-10s %-18s %8s %12s\n", "category", "phase", "count", "time(ms)");
+  for (auto& t: totals)
+    fprintf(stderr, "%-10s %-18s %8ld %12.3f\n", t.first.first.c_str(), t.first.second.c_str(), t.second.first, t.second.second/1000.0);
+  fputs("\n", stderr);
+  fprintf(stderr, "%12s %-10s %-18s %21s %21s %10s %12s  %s\n", "time(ms)", "category", "phase", "states", "edges", "assoc", "peak RSS(KB)", "DefineStmt");
+  for (auto& e: events)
+    fprintf(stderr, "%12.3f %-10s %-18s %10ld->%-9ld %10ld->%-9ld %10ld %12ld  %s\n", e.dur/1000.0, e.category, e.phase, e.states0, e.states, e.edges0, e.edges, e.assoc, e.peak_rss, e.stmt.c_str());
+  if (opt_profile_trace)
+    write_trace(opt_profile_trace);
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "fsa_anno.hh"
+#include "syntax.hh"
+
+// --profile: wall time, automaton sizes and peak RSS of the phases of compiling a DefineStmt.
+// A phase lasts until the next begin() or end(); sizes of `anno` are taken at both ends.
+struct Profiler {
+  Profiler(DefineStmt* stmt, const char* category, const FsaAnno& anno);
+  ~Profiler() { end(); }
+  void begin(const char* phase);
+  void end();
+private:
+  DefineStmt* stmt;
+  const char* category;
+  const FsaAnno& anno;
+  const char* phase = nullptr;
+  long start, states, edges;
+};
+
+// prints the report sorted by time and writes --profile-trace
+void profile_report();
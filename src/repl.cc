@@ -24,6 +24,7 @@ using namespace std;
 enum class ReplMode {string, integer};
 static ReplMode mode = ReplMode::string;
 static const FsaAnno* anno;
+static Fsa fsa; // thawed if `anno` is an export
 static bool quit;
 
 struct Command
@@ -31,7 +32,7 @@ struct Command
   const char* name;
   function<void(const char*)> fn;
 } commands[] = {
-  {".automaton", [](const char*) {print_automaton(anno->fsa); }},
+  {".automaton", [](const char*) {print_automaton(fsa); }},
   {".assoc", [](const char*) {print_assoc(*anno); }},
   {".help",
     [](const char*) {
@@ -69,6 +70,7 @@ struct Command
         printf("'%s' is a macro\n", arg);
       else if (auto d = dynamic_cast<DefineStmt*>(r)) {
         anno = &compiled[d];
+        fsa = anno->dfa.n() ? anno->dfa.thaw() : anno->fsa;
         printf("%s :: DefineStmt\n", d->lhs.c_str());
       } else
         assert(0);
@@ -208,21 +210,21 @@ void repl(DefineStmt* stmt)
       continue;
     }
 
-    long u = anno->fsa.start;
+    long u = fsa.start;
 
     if (mode == ReplMode::string) {
       i32 i = 0, len;
       long c;
       len = strlen(line);
-      if (anno->fsa.is_final(u)) yellow(1);
+      if (fsa.is_final(u)) yellow(1);
       else normal_yellow(1);
       printf("%ld ", u); sgr0();
       while (i < len) {
         U8_NEXT_OR_FFFD(line, i, len, c);
         if (iswcntrl(c)) printf("%ld ", c);
         else printf("%lc ", wint_t(c));
-        u = anno->fsa.transit(u, c);
-        if (anno->fsa.is_final(u)) yellow();
+        u = fsa.transit(u, c);
+        if (fsa.is_final(u)) yellow();
         else normal_yellow();
         printf("%ld ", u); sgr0();
         if (u < 0) break;
@@ -259,7 +261,7 @@ void repl(DefineStmt* stmt)
           input.push_back(yylval.integer);
           break;
         case STRING_LITERAL:
-          if (opt_bytes)
+          if (opt_bytes || opt_utf8)
             for (unsigned char c: *yylval.str)
               input.push_back(c);
           else
@@ -282,13 +284,13 @@ void repl(DefineStmt* stmt)
       raw_yylex_destroy(lexer);
 
       if (u >= 0) {
-        if (anno->fsa.is_final(u)) yellow(1);
+        if (fsa.is_final(u)) yellow(1);
         else normal_yellow(1);
         printf("%ld ", u); sgr0();
         for (long c: input) {
           printf("%ld ", c);
-          u = anno->fsa.transit(u, c);
-          if (anno->fsa.is_final(u)) yellow();
+          u = fsa.transit(u, c);
+          if (fsa.is_final(u)) yellow();
           else normal_yellow();
           printf("%ld ", u); sgr0();
           if (u < 0) break;
@@ -300,7 +302,7 @@ void repl(DefineStmt* stmt)
     if (u >= 0) {
       unordered_map<DefineStmt*, vector<long>> start_finals;
       unordered_map<DefineStmt*, vector<pair<long, long>>> inners;
-      for (auto aa: anno->assoc[u]) {
+      for (auto aa: assoc_set(anno->assoc[u])) {
         if (has_start(aa.second))
           start_finals[aa.first->stmt].push_back(aa.first->loc.start);
         if (has_inner(aa.second)) {
@@ -0,0 +1,88 @@
+// Builds each DefineStmt with the Thompson construction (compile) and from Brzozowski derivatives (derivatives_dfa),
+// minimizes both and checks that they accept the same language.
+#include "compiler.hh"
+#include "derivative.hh"
+#include "fsa_anno.hh"
+#include "loader.hh"
+#include "option.hh"
+#include "unittest/unittest_helper.hh"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+using namespace std;
+
+// DefineStmt are listed after those they embed
+const char codepoint_grammar[] =
+"digit = [0-9]\n"
+"word = [a-z]+\n"
+"complement = ~'ab'\n"
+"intersect = word && ~(word 'x' word)\n"
+"difference = (word | digit+) - 'abc'*\n"
+"repeat = ('ab' | digit){2,4}\n"
+"repeat_unbounded = (digit 'a'?){2,}\n"
+"nested = ~(digit{1,3}) && (digit | 'a')*\n"
+"mixed = (~word - '') digit? && ~~(. 'q')\n"
+"empty = 'x'{0,3} - ('x' | 'xx' | '' | 'xxx')\n"
+"bracket = ~(word{2,} | [^0-9])\n"
+;
+
+const char utf8_grammar[] =
+"greek = [\\u03b1-\\u03c9]+\n"
+"utf8_complement = ~greek\n"
+"utf8_intersect = ~'\\u00e9' && (. .)*\n"
+"utf8_difference = (greek | [a-z]) - ~[\\u03b1-\\u03b3]\n"
+"utf8_repeat = ~(. [\\u4e00-\\u9fff]){1,2}\n"
+;
+
+static long n_errors;
+
+static void check(const char* grammar, vector<string>& files)
+{
+  char filename[] = "/tmp/XXXXXX";
+  int fd = mkstemp(filename);
+  write(fd, grammar, strlen(grammar));
+  close(fd);
+  files.push_back(filename);
+  if (load(filename)) {
+    n_errors++;
+    return;
+  }
+  action_label_base = AB;
+  call_label_base = collapse_label_base = action_label_base+LABEL_BLOCK;
+  long block = 0;
+  for (Stmt* x = main_module->toplevel; x; x = x->next)
+    if (auto stmt = dynamic_cast<DefineStmt*>(x)) {
+      const char* what = NULL;
+      compiled[stmt];
+      compile(stmt, block++);
+      auto relate = [](vector<long>&) {};
+      const Fsa& thompson = compiled[stmt].fsa;
+      Fsa derivatives = FrozenFsa(derivatives_dfa(*stmt->rhs)).distinguish(relate);
+      if (! derivatives_applicable(stmt))
+        what = "not applicable";
+      else if (! is_dfa(derivatives))
+        what = "not a DFA";
+      else if (! equivalent(thompson, derivatives))
+        what = "languages differ";
+      printf("%s: %ld %ld %s\n", stmt->lhs.c_str(), thompson.n(), derivatives.n(), what ? what : "ok");
+      if (what)
+        n_errors++;
+    }
+}
+
+int main()
+{
+  debug_file = stderr;
+  debug_level = 0;
+  opt_check = true;
+  vector<string> files;
+  check(codepoint_grammar, files);
+  opt_utf8 = true;
+  check(utf8_grammar, files);
+  for (auto& f: files)
+    unlink(f.c_str());
+  unload_all();
+  return n_errors ? 1 : 0;
+}
@@ -32,10 +32,10 @@ int main(int argc, char *argv[])
     unlink(filename);
   }
 
-  auto relate = [](const vector<long>&) {};
-  Fsa fsa = read_nfa().determinize(relate);
+  auto relate = [](long, const vector<long>&) {};
+  Fsa fsa = read_nfa().determinize(NULL, relate);
   print_fsa(fsa);
 
   if (argc == 1)
-    return fsa.n() == 4 ? 0 : 1;
+    return fsa.n() == 4 && is_dfa(fsa) ? 0 : 1;
 }
@@ -8,7 +8,9 @@
 #include <unistd.h>
 using namespace std;
 
+// pairs of operands
 const char test[] =
+// DFA, DFA
 "4 4 1\n"
 "3  \n"
 "0 0 1\n"
@@ -22,6 +24,58 @@ const char test[] =
 "0 1 2\n"
 "1 1 3\n"
 "2 1 3\n"
+
+// (0|1)*1(0|1), 0*1(0|1)* with epsilon edges
+"3 5 1\n"
+"2\n"
+"0 0 0\n"
+"0 1 0\n"
+"0 1 1\n"
+"1 0 2\n"
+"1 1 2\n"
+
+"4 6 1\n"
+"3\n"
+"0 -1 1\n"
+"1 0 1\n"
+"1 1 2\n"
+"2 -1 3\n"
+"3 0 3\n"
+"3 1 3\n"
+
+// dead start
+"2 1 0\n"
+"\n"
+"0 0 1\n"
+
+"1 1 1\n"
+"0\n"
+"0 0 0\n"
+
+// dead right side
+"2 3 1\n"
+"1\n"
+"0 0 1\n"
+"0 -1 1\n"
+"1 1 1\n"
+
+"2 2 0\n"
+"\n"
+"0 -1 1\n"
+"1 0 1\n"
+
+// the right side dies after 0
+"1 3 1\n"
+"0\n"
+"0 0 0\n"
+"0 1 0\n"
+"0 2 0\n"
+
+"3 3 1\n"
+"1\n"
+"0 0 1\n"
+"0 -1 2\n"
+"2 0 1\n"
 ;
 
 int main(int argc, char *argv[])
@@ -35,10 +89,33 @@ int main(int argc, char *argv[])
     unlink(filename);
   }
 
-  auto relate = [](long u, long v) {};
-  Fsa a = read_dfa(), b = read_dfa(), fsa = a.difference(b, relate);
-  print_fsa(fsa);
-
-  if (argc == 1)
-    return 0; // fsa.n() == 4 ? 0 : 1;
+  long n_errors = 0;
+  while (cin >> ws, ! cin.eof()) {
+    Fsa a = read_nfa(), b = read_nfa();
+    for (bool trim: {true, false}) {
+      long n_relate = 0;
+      bool ok = true;
+      auto relate = [&](const vector<long>& xs) {
+        n_relate++;
+        if (xs.empty() || ! is_sorted(xs.begin(), xs.end()))
+          ok = false;
+        for (long x: xs)
+          if (x < 0 || a.n() <= x)
+            ok = false;
+      };
+      Fsa fsa = a.difference(b, relate, trim);
+      print_fsa(fsa);
+      if (! is_dfa(fsa) || n_relate != fsa.n())
+        ok = false;
+      each_string(3, 6, [&](const vector<long>& s) {
+        if (accepts(fsa, s) != (accepts(a, s) && ! accepts(b, s)))
+          ok = false;
+      });
+      if (! ok) {
+        n_errors++;
+        puts("FAIL");
+      }
+    }
+  }
+  return n_errors ? 1 : 0;
 }
@@ -0,0 +1,66 @@
+// Builds each DefineStmt with and without --early-minimize and checks that the automata accept the same language.
+#include "compiler.hh"
+#include "fsa_anno.hh"
+#include "loader.hh"
+#include "option.hh"
+#include "unittest/unittest_helper.hh"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+using namespace std;
+
+// DefineStmt are listed after those they embed
+const char test[] =
+"action a { f(); }\n"
+"digit = [0-9]\n"
+"word = [a-z]+\n"
+"concat = (word ' ' word | digit+ '.' digit*) ('e' digit{1,3})?\n"
+"alternation = (('a' | 'b')* 'a' ('a' | 'b'){3} | 'c'+ digit?)+\n"
+"complement = ~(word 'x') && (word | digit)*\n"
+"difference = ('x' | 'y'){1,8} - ('x' 'y')*\n"
+"actions = ((word > a) ' ')* digit+ @ a\n"
+"nested = ((('ab')* 'c')* | ~('ab'* 'c'))* 'd'\n"
+;
+
+int main()
+{
+  debug_file = stderr;
+  debug_level = 0;
+  opt_check = true;
+  char filename[] = "/tmp/XXXXXX";
+  int fd = mkstemp(filename);
+  write(fd, test, sizeof test-1);
+  close(fd);
+  long n_errors = load(filename);
+  unlink(filename);
+  if (n_errors)
+    return 1;
+  action_label_base = AB;
+  call_label_base = collapse_label_base = action_label_base+LABEL_BLOCK;
+
+  long block = 0;
+  for (Stmt* x = main_module->toplevel; x; x = x->next)
+    if (auto stmt = dynamic_cast<DefineStmt*>(x)) {
+      compiled[stmt];
+      opt_early_minimize = 0;
+      opt_early_minimize_eps = 0;
+      compile(stmt, block);
+      Fsa plain = compiled[stmt].fsa;
+      bool ok = true;
+      // every subexpression, then by epsilon edges per state
+      for (auto option: {make_pair(1L, 0.0), make_pair(0L, 0.5)}) {
+        opt_early_minimize = option.first;
+        opt_early_minimize_eps = option.second;
+        compile(stmt, block);
+        if (! equivalent(plain, compiled[stmt].fsa))
+          ok = false;
+      }
+      block++;
+      printf("%s: %s\n", stmt->lhs.c_str(), ok ? "ok" : "languages differ");
+      if (! ok)
+        n_errors++;
+    }
+  unload_all();
+  return n_errors ? 1 : 0;
+}
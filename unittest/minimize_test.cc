@@ -30,8 +30,8 @@ int main(int argc, char *argv[])
     unlink(filename);
   }
 
-  auto relate = [](const vector<long>&) {};
-  Fsa fsa = read_dfa().minimize(relate);
+  auto relate = [](vector<long>&) {};
+  Fsa fsa = FrozenFsa(read_dfa()).distinguish(relate);
   print_fsa(fsa);
 
   if (argc == 1)
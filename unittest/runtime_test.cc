@@ -0,0 +1,172 @@
+// Matches with libyanshi_rt on the --emit-binary image of runtime_test.ys and with the C++ generated from the
+// same grammar, and compares stop positions, states, return stacks and action traces. The Makefile generates
+// both and passes the image path as IMAGE.
+#include "common.hh"
+#include "runtime/yanshi_rt.hh"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+
+extern long yanshi_main_start;
+bool yanshi_main_is_final(const vector<long>& ret_stack, long u);
+long yanshi_main_transit(vector<long>& ret_stack, long u, long c);
+const uint8_t* yanshi_main_exec(vector<long>& ret_stack, long* state, const uint8_t* p, const uint8_t* pe);
+
+static vector<long> trace;
+
+void act(long x)
+{
+  trace.push_back(x);
+}
+
+static const char* inputs[] = {
+  "", "abc", "N12", "L[N1,abc]", "L[L[x],N7] αβγ", "N1 N2 L[]", "L[N1,", "N", "L[N1]]", "N1x",
+  "ab \xce", "ab\xce\xb1", "\xff", "L[\xce\xb1,", "A",
+};
+
+static long n_errors;
+
+static void fail(const char* input, const char* what)
+{
+  n_errors++;
+  printf("'%s': %s\n", input, what);
+}
+
+// UTF-8 sequences of `s` that the matchers decode to one codepoint; stops at an invalid or incomplete one
+static vector<long> codepoints(const char* s)
+{
+  vector<long> r;
+  for (auto p = (const uint8_t*)s; *p; ) {
+    long c = *p, n = c < 0x80 ? 0 : 0xc2 <= c && c < 0xe0 ? 1 : 0xe0 <= c && c < 0xf0 ? 2 : -1;
+    if (n < 0)
+      break;
+    c &= 0x7f >> n;
+    REP(i, n) {
+      if ((p[i+1] & 0xc0) != 0x80)
+        return r;
+      c = c << 6 | (p[i+1] & 0x3f);
+    }
+    r.push_back(c);
+    p += n+1;
+  }
+  return r;
+}
+
+static void compare(const YanshiMatcher& m, const char* input)
+{
+  auto p = (const uint8_t*)input, pe = p+strlen(input);
+
+  vector<long> gen_stack, rt_stack;
+  long gen_u = yanshi_main_start, rt_u = m.start();
+  const uint8_t* gen_q = yanshi_main_exec(gen_stack, &gen_u, p, pe);
+  const uint8_t* rt_q = m.exec(rt_stack, &rt_u, p, pe);
+  if (gen_q != rt_q || gen_u != rt_u || gen_stack != rt_stack)
+    fail(input, "exec differs");
+  else if (gen_u >= 0 && yanshi_main_is_final(gen_stack, gen_u) != m.is_final(rt_stack, rt_u))
+    fail(input, "is_final differs");
+
+  gen_stack.clear();
+  rt_stack.clear();
+  gen_u = yanshi_main_start;
+  rt_u = m.start();
+  for (long c: codepoints(input)) {
+    trace.clear();
+    gen_u = yanshi_main_transit(gen_stack, gen_u, c);
+    vector<long> rt_trace;
+    long edge, n;
+    rt_u = m.transit(rt_stack, rt_u, c, &edge);
+    const int64_t* ids = m.actions(edge, &n);
+    REP(i, n) {
+      const char* code = strstr(m.action_code(ids[i]), "act(");
+      rt_trace.push_back(code ? atol(code+4) : -1);
+    }
+    if (gen_u != rt_u || gen_stack != rt_stack || trace != rt_trace) {
+      fail(input, "transit differs");
+      break;
+    }
+    if (gen_u < 0)
+      break;
+  }
+}
+
+static string read_file(const char* path)
+{
+  string r;
+  FILE* f = fopen(path, "rb");
+  if (! f)
+    return r;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof buf, f)) > 0)
+    r.append(buf, n);
+  fclose(f);
+  return r;
+}
+
+// YanshiImage::open must reject `data`
+static void reject(const string& data, const char* what)
+{
+  char filename[] = "/tmp/XXXXXX";
+  int fd = mkstemp(filename);
+  write(fd, data.data(), data.size());
+  close(fd);
+  string err;
+  auto image = YanshiImage::open(filename, &err);
+  unlink(filename);
+  if (image)
+    fail(what, "corrupted image accepted");
+  else
+    printf("%s: %s\n", what, err.c_str());
+}
+
+int main()
+{
+  string err;
+  auto image = YanshiImage::open(IMAGE, &err);
+  if (! image) {
+    printf("%s\n", err.c_str());
+    return 1;
+  }
+  YanshiMatcher m(image, "main");
+  if (! m) {
+    puts("no export 'main'");
+    return 1;
+  }
+  for (const char* input: inputs)
+    compare(m, input);
+
+  string data = read_file(IMAGE);
+  reject(data.substr(0, data.size()-8), "truncated");
+  reject(data.substr(0, sizeof(yanshi_bin_header)-1), "truncated header");
+  auto corrupt = [&](const char* what, void (*f)(char* base, yanshi_bin_header* h, yanshi_bin_automaton* a)) {
+    string t = data;
+    auto h = (yanshi_bin_header*)&t[0];
+    f(&t[0], h, (yanshi_bin_automaton*)&t[h->automata]);
+    reject(t, what);
+  };
+  corrupt("bad magic", [](char* base, yanshi_bin_header* h, yanshi_bin_automaton* a) { h->magic[0] ^= 1; });
+  corrupt("bad version", [](char* base, yanshi_bin_header* h, yanshi_bin_automaton* a) { h->version++; });
+  corrupt("bad start", [](char* base, yanshi_bin_header* h, yanshi_bin_automaton* a) { a->start = a->n_states; });
+  corrupt("bad edge target", [](char* base, yanshi_bin_header* h, yanshi_bin_automaton* a) {
+    ((yanshi_bin_edge*)(base+a->edges))->target = a->n_states;
+  });
+  corrupt("bad edge offset", [](char* base, yanshi_bin_header* h, yanshi_bin_automaton* a) {
+    ((int64_t*)(base+a->edge_offset))[1] = a->n_edges+1;
+  });
+  corrupt("bad call", [](char* base, yanshi_bin_header* h, yanshi_bin_automaton* a) {
+    ((yanshi_bin_call*)(base+a->calls))[a->start].start = a->n_states;
+  });
+
+  // a failed reload keeps the current image
+  YanshiReloadable r;
+  r.swap(image);
+  if (r.reload("/nonexistent") || r.snapshot() != image)
+    fail("reload", "current image lost");
+
+  return n_errors ? 1 : 0;
+}
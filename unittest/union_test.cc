@@ -1,4 +1,4 @@
-#include "fsa.hh"
+#include "fsa_anno.hh"
 #include "unittest/unittest_helper.hh"
 
 #include <algorithm>
@@ -37,8 +37,15 @@ int main(int argc, char *argv[])
     unlink(filename);
   }
 
-  auto relate = [](long u, long v) {};
-  Fsa a = read_dfa(), b = read_dfa(), fsa = a.union_(b, relate);
+  FsaAnno a, b;
+  a.fsa = read_dfa();
+  a.assoc.resize(a.fsa.n());
+  b.fsa = read_dfa();
+  b.assoc.resize(b.fsa.n());
+  a.union_(b, NULL);
+  a.determinize(NULL, NULL);
+  a.minimize(NULL);
+  const Fsa& fsa = a.fsa;
   print_fsa(fsa);
 
   if (argc == 1)
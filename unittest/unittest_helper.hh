@@ -9,6 +9,7 @@
 #include <iostream>
 using namespace std;
 
+// n m k, k finals, m edges `u c v`. c is a byte, -1 is an epsilon edge
 static Fsa read_nfa()
 {
   long n, m, k, u, a, v;
@@ -29,7 +30,10 @@ static Fsa read_nfa()
       errx(EX_DATAERR, "%ld: -1 <= c < 256", a);
     if (v < 0 || v >= n)
       errx(EX_DATAERR, "%ld: 0 <= v < n", v);
-    r.adj[u].emplace_back(a, v);
+    if (a < 0)
+      r.add_epsilon(u, v);
+    else
+      r.adj[u].emplace_back(make_pair(a, a+1), v);
   }
   assert(cin.good());
   REP(i, n)
@@ -40,20 +44,82 @@ static Fsa read_nfa()
 static Fsa read_dfa()
 {
   Fsa r = read_nfa();
+  REP(i, r.eps.size())
+    if (r.eps[i].size())
+      errx(EX_DATAERR, "epsilon edge found for %ld", i);
   REP(i, r.n())
-    if (r.adj[i].size()) {
-      if (r.adj[i][0].first < 0)
-        errx(EX_DATAERR, "epsilon edge found for %ld", i);
-      REP(j, r.adj[i].size()-1)
-        if (r.adj[i][j].first == r.adj[i][j+1].first)
-          errx(EX_DATAERR, "duplicate labels %ld found for %ld", r.adj[i][j].first, i);
-    }
-  assert(cin.good());
+    FOR(j, 1, r.adj[i].size())
+      if (r.adj[i][j-1].first.second > r.adj[i][j].first.first)
+        errx(EX_DATAERR, "duplicate labels %ld found for %ld", r.adj[i][j].first.first, i);
   return r;
 }
 
+// whether `fsa` accepts the byte string `s`, following epsilon edges
+static bool accepts(const Fsa& fsa, const vector<long>& s)
+{
+  vector<bool> cur(fsa.n()), next(fsa.n());
+  function<void(vector<bool>&, long)> add = [&](vector<bool>& set, long u) {
+    if (set[u])
+      return;
+    set[u] = true;
+    if (u < fsa.eps.size())
+      for (long v: fsa.eps[u])
+        add(set, v);
+  };
+  add(cur, fsa.start);
+  for (long c: s) {
+    next.assign(fsa.n(), false);
+    REP(u, fsa.n())
+      if (cur[u])
+        for (auto& e: fsa.adj[u])
+          if (e.first.first <= c && c < e.first.second)
+            add(next, e.second);
+    cur.swap(next);
+  }
+  REP(u, fsa.n())
+    if (cur[u] && fsa.is_final(u))
+      return true;
+  return false;
+}
+
+// calls f on every string over [0, alphabet) of length at most `len`
+static void each_string(long alphabet, long len, const function<void(const vector<long>&)>& f)
+{
+  vector<long> s;
+  function<void()> go = [&]() {
+    f(s);
+    if (s.size() < len)
+      REP(c, alphabet) {
+        s.push_back(c);
+        go();
+        s.pop_back();
+      }
+  };
+  go();
+}
+
+// whether the languages of `a` and `b` are equal
+static bool equivalent(const Fsa& a, const Fsa& b)
+{
+  auto relate = [](const vector<long>&) {};
+  return a.difference(b, relate).finals.empty() && b.difference(a, relate).finals.empty();
+}
+
+static bool is_dfa(const Fsa& fsa)
+{
+  for (auto& es: fsa.eps)
+    if (es.size())
+      return false;
+  REP(i, fsa.n())
+    FOR(j, 1, fsa.adj[i].size())
+      if (fsa.adj[i][j-1].first.second > fsa.adj[i][j].first.first)
+        return false;
+  return true;
+}
+
 static void print_fsa(const Fsa& fsa)
 {
+  printf("start: %ld\n", fsa.start);
   printf("finals:");
   for (long i: fsa.finals)
     printf(" %ld", i);
@@ -62,7 +128,13 @@ static void print_fsa(const Fsa& fsa)
   REP(i, fsa.n()) {
     printf("%ld:", i);
     for (auto& x: fsa.adj[i])
-      printf(" (%ld,%ld)", x.first, x.second);
+      if (x.first.first == x.first.second-1)
+        printf(" (%ld,%ld)", x.first.first, x.second);
+      else
+        printf(" (%ld-%ld,%ld)", x.first.first, x.first.second-1, x.second);
+    if (i < fsa.eps.size())
+      for (long v: fsa.eps[i])
+        printf(" (eps,%ld)", v);
     puts("");
   }
 }